@@ -33,6 +33,7 @@ class PvApiTestApp : public App
 	bool mThreadShouldQuit = false;
 	void openCameraThreadFn();
 	std::string mCameraProgress;
+	int32_t mFramesDropped = 0;
 };
 
 void PvApiTestApp::setup()
@@ -46,6 +47,7 @@ void PvApiTestApp::setup()
 	mParams->setPosition( ivec2( 10 ) );
 
 	mParams->addParam( "Camera", &mCameraProgress, true );
+	mParams->addParam( "Frames dropped", &mFramesDropped, true );
 	mParams->addButton( "Start", [ this ]() { if ( mCapturePvApi ) mCapturePvApi->start(); } );
 	mParams->addButton( "Stop", [ this ]() { if ( mCapturePvApi ) mCapturePvApi->stop(); } );
 }
@@ -98,6 +100,7 @@ void PvApiTestApp::update()
 		{
 			mTexture = gl::Texture2d::create( *surface );
 		}
+		mFramesDropped = mCapturePvApi->getNumFramesDropped();
 	}
 }
 
@@ -0,0 +1,167 @@
+#include <algorithm>
+
+#include "BlockPool.h"
+
+namespace mndl { namespace pvapi {
+
+const size_t BlockPool::kMaxBlocks;
+const size_t BlockPool::kNoIndex;
+
+//! The budget of a pool. Its blocks hold it, so that a block freed after the
+//! pool is gone still removes its bytes from the budget the pool had then.
+struct BlockPool::Account
+{
+	std::mutex mMutex;
+	PoolBudgetRef mBudget;
+};
+
+BlockPool::BlockPool( size_t blockBytes, const FrameBufferOptions &options ) :
+	mBlockBytes( blockBytes ), mOptions( options ), mBlocks( new std::shared_ptr< uint8_t >[ kMaxBlocks ] ),
+	mAccount( std::make_shared< Account >() ), mFreeList( kMaxBlocks )
+{
+}
+
+void BlockPool::setBudget( const PoolBudgetRef &budget )
+{
+	std::lock_guard< std::mutex > lock( mReserveMutex );
+	std::lock_guard< std::mutex > accountLock( mAccount->mMutex );
+	// the pool holds all of its blocks, so they are moved to the new budget together
+	const size_t numBytes = size() * mBlockBytes;
+	if ( mAccount->mBudget )
+	{
+		mAccount->mBudget->remove( numBytes );
+	}
+	mAccount->mBudget = budget;
+	if ( budget )
+	{
+		budget->add( numBytes );
+	}
+}
+
+PoolBudgetRef BlockPool::getBudget() const
+{
+	std::lock_guard< std::mutex > lock( mAccount->mMutex );
+	return mAccount->mBudget;
+}
+
+std::shared_ptr< uint8_t > BlockPool::allocateBlock()
+{
+	std::shared_ptr< uint8_t > data = allocateFrameBuffer( mBlockBytes, mOptions );
+	std::shared_ptr< Account > account = mAccount;
+	const size_t numBytes = mBlockBytes;
+	// the deleter holds the buffer, it is freed right after the bytes are removed
+	return std::shared_ptr< uint8_t >( data.get(),
+			[ data, account, numBytes ]( uint8_t * )
+			{
+				std::lock_guard< std::mutex > lock( account->mMutex );
+				if ( account->mBudget )
+				{
+					account->mBudget->remove( numBytes );
+				}
+			} );
+}
+
+void BlockPool::reserve( size_t numBlocks )
+{
+	std::lock_guard< std::mutex > lock( mReserveMutex );
+	size_t n = mNumBlocks.load( std::memory_order_relaxed );
+	while ( n < std::min( numBlocks, kMaxBlocks ) )
+	{
+		mBlocks[ n ] = allocateBlock();
+		{
+			std::lock_guard< std::mutex > accountLock( mAccount->mMutex );
+			if ( mAccount->mBudget )
+			{
+				mAccount->mBudget->add( mBlockBytes );
+			}
+		}
+		mFreeList.push( n );
+		mNumBlocks.store( ++n, std::memory_order_relaxed );
+	}
+}
+
+bool BlockPool::grow( size_t *index )
+{
+	std::lock_guard< std::mutex > lock( mReserveMutex );
+	const size_t n = mNumBlocks.load( std::memory_order_relaxed );
+	if ( n >= kMaxBlocks )
+	{
+		return false;
+	}
+	{
+		std::lock_guard< std::mutex > accountLock( mAccount->mMutex );
+		if ( mAccount->mBudget && ! mAccount->mBudget->tryAdd( mBlockBytes ) )
+		{
+			return false;
+		}
+	}
+
+	mBlocks[ n ] = allocateBlock();
+	mNumBlocks.store( n + 1, std::memory_order_relaxed );
+	*index = n;
+	return true;
+}
+
+BlockPool::Block BlockPool::acquire()
+{
+	mNumAcquired.fetch_add( 1, std::memory_order_relaxed );
+	const size_t numInUse = mNumInUse.fetch_add( 1, std::memory_order_relaxed ) + 1;
+	size_t highWater = mHighWater.load( std::memory_order_relaxed );
+	while ( numInUse > highWater && ! mHighWater.compare_exchange_weak( highWater, numInUse, std::memory_order_relaxed ) )
+	{
+	}
+
+	Block block;
+	if ( ! mFreeList.pop( &block.mIndex ) )
+	{
+		mNumMisses.fetch_add( 1, std::memory_order_relaxed );
+		if ( grow( &block.mIndex ) )
+		{
+			mNumGrown.fetch_add( 1, std::memory_order_relaxed );
+		}
+		else
+		{
+			// not counted against the budget, freed when returned
+			block.mIndex = kNoIndex;
+			block.mData = allocateFrameBuffer( mBlockBytes, mOptions );
+			return block;
+		}
+	}
+
+	block.mData = mBlocks[ block.mIndex ];
+	return block;
+}
+
+void BlockPool::release( const std::weak_ptr< BlockPool > &pool, size_t index )
+{
+	if ( BlockPoolRef p = pool.lock() )
+	{
+		p->mNumInUse.fetch_sub( 1, std::memory_order_relaxed );
+		if ( index != kNoIndex )
+		{
+			p->mFreeList.push( index );
+		}
+	}
+}
+
+PoolStats BlockPool::getStats() const
+{
+	PoolStats stats;
+	stats.mNumBlocks = size();
+	stats.mNumInUse = mNumInUse.load( std::memory_order_relaxed );
+	stats.mHighWater = mHighWater.load( std::memory_order_relaxed );
+	stats.mNumAcquired = mNumAcquired.load( std::memory_order_relaxed );
+	stats.mNumMisses = mNumMisses.load( std::memory_order_relaxed );
+	stats.mNumGrown = mNumGrown.load( std::memory_order_relaxed );
+	return stats;
+}
+
+void BlockPool::resetStats()
+{
+	mHighWater = mNumInUse.load();
+	mNumAcquired = 0;
+	mNumMisses = 0;
+	mNumGrown = 0;
+}
+
+} } // mndl::pvapi
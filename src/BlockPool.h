@@ -0,0 +1,162 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "FrameAllocator.h"
+#include "FreeList.h"
+
+namespace mndl { namespace pvapi {
+
+typedef std::shared_ptr< class BlockPool > BlockPoolRef;
+typedef std::shared_ptr< class PoolBudget > PoolBudgetRef;
+
+//! Memory the pools sharing it may hold. The blocks reserved up front are
+//! always counted, the pools only grow on a miss while the total stays
+//! within the limit. A block is counted until it is freed, also while a
+//! channel or surface holds it after its pool is gone. The blocks allocated
+//! on their own past the limit are not counted.
+class PoolBudget
+{
+  public:
+	static PoolBudgetRef create( size_t maxBytes )
+	{ return PoolBudgetRef( new PoolBudget( maxBytes ) ); }
+
+	void setMaxBytes( size_t maxBytes ) { mMaxBytes = maxBytes; }
+	size_t getMaxBytes() const { return mMaxBytes; }
+	//! Returns the bytes of the blocks of the pools, including the blocks still held after their pool is gone.
+	size_t getNumBytes() const { return mNumBytes; }
+
+	void add( size_t bytes ) { mNumBytes += bytes; }
+	//! Adds \a bytes if they fit into the limit, returns false otherwise.
+	bool tryAdd( size_t bytes )
+	{
+		size_t numBytes = mNumBytes.load();
+		do
+		{
+			if ( numBytes + bytes > mMaxBytes )
+			{
+				return false;
+			}
+		}
+		while ( ! mNumBytes.compare_exchange_weak( numBytes, numBytes + bytes ) );
+		return true;
+	}
+	void remove( size_t bytes ) { mNumBytes -= bytes; }
+
+  protected:
+	explicit PoolBudget( size_t maxBytes ) : mMaxBytes( maxBytes ) {}
+
+	std::atomic< size_t > mMaxBytes;
+	std::atomic< size_t > mNumBytes { 0 };
+};
+
+//! Counters of the blocks taken from pools.
+struct PoolStats
+{
+	//! blocks of the pools
+	size_t mNumBlocks = 0;
+	//! blocks taken and not returned yet, including the ones allocated past the pools
+	size_t mNumInUse = 0;
+	//! the most blocks in use at once
+	size_t mHighWater = 0;
+	uint64_t mNumAcquired = 0;
+	//! blocks taken while all blocks of the pool were in use
+	uint64_t mNumMisses = 0;
+	//! misses the pool grew by a block for, the others were allocated on their own
+	uint64_t mNumGrown = 0;
+
+	PoolStats & operator+=( const PoolStats &other )
+	{
+		mNumBlocks += other.mNumBlocks;
+		mNumInUse += other.mNumInUse;
+		mHighWater += other.mHighWater;
+		mNumAcquired += other.mNumAcquired;
+		mNumMisses += other.mNumMisses;
+		mNumGrown += other.mNumGrown;
+		return *this;
+	}
+};
+
+//! Blocks of pixel data of one size behind a cache. The pool is owned by its
+//! cache, the blocks are reference counted on their own, so a block taken by
+//! a channel or surface stays valid after the cache and the pool are gone.
+//! Returning a block holds the pool weakly, after the pool is gone it only
+//! drops the block. When all blocks are taken the pool grows by a block as
+//! long as its budget allows it. The new block is returned to the pool like
+//! the others, so the allocations stop once the pool fits the demand. Past
+//! the budget or kMaxBlocks a block is allocated on its own, it is not
+//! counted against the budget and is freed when returned instead of being
+//! added to the pool.
+class BlockPool
+{
+  public:
+	//! the most blocks a pool holds
+	static const size_t kMaxBlocks = 256;
+	//! index of the blocks allocated past the pool, freed when returned and not counted against the budget
+	static const size_t kNoIndex = ~size_t( 0 );
+
+	//! A block taken from the pool, returned to it by release().
+	struct Block
+	{
+		size_t mIndex;
+		std::shared_ptr< uint8_t > mData;
+	};
+
+	static BlockPoolRef create( size_t blockBytes, const FrameBufferOptions &options = FrameBufferOptions() )
+	{ return BlockPoolRef( new BlockPool( blockBytes, options ) ); }
+
+	size_t getBlockBytes() const { return mBlockBytes; }
+	const FrameBufferOptions & getOptions() const { return mOptions; }
+	//! Returns the number of blocks allocated.
+	size_t size() const { return mNumBlocks.load( std::memory_order_relaxed ); }
+
+	//! Sets the budget the pool grows within on misses, null grows up to kMaxBlocks.
+	void setBudget( const PoolBudgetRef &budget );
+	PoolBudgetRef getBudget() const;
+
+	//! Grows the pool to at least \a numBlocks blocks, up to kMaxBlocks, regardless of the budget.
+	void reserve( size_t numBlocks );
+
+	//! Takes a free block. Lock-free unless all blocks are taken, then the
+	//! pool grows or the block is allocated on its own.
+	Block acquire();
+	//! Returns a block taken from \a pool, a no-op if the pool is gone. Lock-free.
+	static void release( const std::weak_ptr< BlockPool > &pool, size_t index );
+
+	PoolStats getStats() const;
+	//! Zeroes the counters, the high-water mark starts over from the blocks in use.
+	void resetStats();
+
+  protected:
+	BlockPool( size_t blockBytes, const FrameBufferOptions &options );
+
+	struct Account;
+
+	//! Adds a block which is taken right away, its index into \a index. Returns false if the budget does not allow it.
+	bool grow( size_t *index );
+	//! Allocates a block of the pool, which removes its bytes from the budget when it is freed.
+	std::shared_ptr< uint8_t > allocateBlock();
+
+	size_t mBlockBytes;
+	FrameBufferOptions mOptions;
+	//! kMaxBlocks slots, filled before their index is handed out
+	std::unique_ptr< std::shared_ptr< uint8_t >[] > mBlocks;
+	std::atomic< size_t > mNumBlocks { 0 };
+	//! Serializes adding blocks.
+	mutable std::mutex mReserveMutex;
+	//! the budget, shared with the blocks of the pool
+	std::shared_ptr< Account > mAccount;
+	FreeList mFreeList;
+
+	std::atomic< size_t > mNumInUse { 0 };
+	std::atomic< size_t > mHighWater { 0 };
+	std::atomic< uint64_t > mNumAcquired { 0 };
+	std::atomic< uint64_t > mNumMisses { 0 };
+	std::atomic< uint64_t > mNumGrown { 0 };
+};
+
+} } // mndl::pvapi
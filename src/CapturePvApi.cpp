@@ -3,13 +3,18 @@
 #include "cinder/Log.h"
 #include "cinder/Utilities.h"
 #include "cinder/app/App.h"
+#include "cinder/ip/Grayscale.h"
 
 #include "CapturePvApi.h"
+#include "Demosaic.h"
+#include "PixelConversion.h"
 
 using namespace ci;
 
 namespace mndl { namespace pvapi {
 
+const size_t CapturePvApi::kMaxCalibrationFrames;
+
 static const std::vector< std::string > sErrors = { "ePvErrSuccess",
 	"ePvErrCameraFault", "ePvErrInternalFault", "ePvErrBadHandle",
 	"ePvErrBadParameter", "ePvErrBadSequence", "ePvErrNotFound",
@@ -32,6 +37,117 @@ static inline std::string getErrorString( const tPvErr &err )
 	}
 }
 
+//! Returns the channel order of the formats captured into surfaces.
+static SurfaceChannelOrder getSurfaceChannelOrder( CapturePvApi::PixelFormat pixelFormat )
+{
+	switch ( pixelFormat )
+	{
+		case CapturePvApi::PixelFormat::BGR24:
+			return SurfaceChannelOrder::BGR;
+
+		case CapturePvApi::PixelFormat::RGBA32:
+			return SurfaceChannelOrder::RGBA;
+
+		case CapturePvApi::PixelFormat::BGRA32:
+			return SurfaceChannelOrder::BGRA;
+
+		default:
+			return SurfaceChannelOrder::RGB;
+	}
+}
+
+//! Replaces \a cache with an empty one of \a options if its options differ.
+template< typename T >
+static void updateCache( std::shared_ptr< ChannelCacheT< T > > &cache, const FrameBufferOptions &options )
+{
+	if ( cache->getOptions() != options )
+	{
+		std::atomic_store( &cache, std::make_shared< ChannelCacheT< T > >( cache->getWidth(), cache->getHeight(), 0, options ) );
+	}
+}
+
+template< typename T >
+static void updateCache( std::shared_ptr< SurfaceCacheT< T > > &cache, const FrameBufferOptions &options )
+{
+	if ( cache->getOptions() != options )
+	{
+		std::atomic_store( &cache, std::make_shared< SurfaceCacheT< T > >( cache->getWidth(), cache->getHeight(), cache->getChannelOrder(), 0, options ) );
+	}
+}
+
+//! Returns the number of significant bits of \a frame, falling back to its storage when the driver does not report it.
+static uint32_t getSignificantBits( const CapturePvApi::Frame &frame )
+{
+	const uint32_t bitDepth = frame.getBitDepth();
+	if ( bitDepth != 0 && bitDepth <= 16 )
+	{
+		return bitDepth;
+	}
+
+	switch ( frame.getPixelFormat() )
+	{
+		case CapturePvApi::PixelFormat::MONO12PACKED:
+		case CapturePvApi::PixelFormat::BAYER12PACKED:
+			return 12;
+
+		case CapturePvApi::PixelFormat::MONO8:
+		case CapturePvApi::PixelFormat::BAYER8:
+			return 8;
+
+		default:
+			return 16;
+	}
+}
+
+//! Returns the bit depth of the levels of Mono and Bayer frames, 0 for the color formats.
+static uint32_t getLevelBits( const CapturePvApi::Frame &frame )
+{
+	switch ( frame.getPixelFormat() )
+	{
+		case CapturePvApi::PixelFormat::MONO8:
+		case CapturePvApi::PixelFormat::BAYER8:
+			return std::min< uint32_t >( getSignificantBits( frame ), 8 );
+
+		case CapturePvApi::PixelFormat::MONO16:
+		case CapturePvApi::PixelFormat::MONO12PACKED:
+		case CapturePvApi::PixelFormat::BAYER16:
+		case CapturePvApi::PixelFormat::BAYER12PACKED:
+			return getSignificantBits( frame );
+
+		default:
+			return 0;
+	}
+}
+
+//! Returns whether \a pixelFormat is a YUV format and sets \a yuvFormat to it if not null.
+static bool getYuvFormat( CapturePvApi::PixelFormat pixelFormat, YuvFormat *yuvFormat )
+{
+	YuvFormat format;
+	switch ( pixelFormat )
+	{
+		case CapturePvApi::PixelFormat::YUV411:
+			format = YuvFormat::YUV411;
+			break;
+
+		case CapturePvApi::PixelFormat::YUV422:
+			format = YuvFormat::YUV422;
+			break;
+
+		case CapturePvApi::PixelFormat::YUV444:
+			format = YuvFormat::YUV444;
+			break;
+
+		default:
+			return false;
+	}
+
+	if ( yuvFormat )
+	{
+		*yuvFormat = format;
+	}
+	return true;
+}
+
 void throwOnPvApiError( const tPvErr &err, const std::string &functionName,
 		const std::string &fileName, const size_t &lineNumber )
 {
@@ -122,7 +238,9 @@ const std::vector< CapturePvApi::DeviceRef > & CapturePvApi::getDevices( bool fo
 	return sDevices;
 }
 
-CapturePvApi::CapturePvApi( const DeviceRef &device )
+CapturePvApi::CapturePvApi( const DeviceRef &device ) :
+	mConversionPool( [ this ]( ConversionJob &job ) { convertFrame( job ); },
+					 [ this ]( ConversionJob &job ) { accumulateFrame( job.mFrame ); publishFrame( job.mFrame ); } )
 {
 	if ( device )
 	{
@@ -169,6 +287,8 @@ CapturePvApi::CapturePvApi( const DeviceRef &device )
 	mChannelCache8u = std::make_shared< ChannelCache8u >( mSensorWidth, mSensorHeight, 4 );
 	mChannelCache16u = std::make_shared< ChannelCache16u >( mSensorWidth, mSensorHeight, 4 );
 	mSurfaceCache8u = std::make_shared< SurfaceCache8u >( mSensorWidth, mSensorHeight, SurfaceChannelOrder::RGB, 4 );
+	mSurfaceCaches8u[ SurfaceChannelOrder::RGB ] = mSurfaceCache8u;
+	mSurfaceCache16u = std::make_shared< SurfaceCache16u >( mSensorWidth, mSensorHeight, SurfaceChannelOrder::RGB, 0 );
 }
 
 CapturePvApi::~CapturePvApi()
@@ -201,6 +321,35 @@ void CapturePvApi::closeDevice()
 	}
 }
 
+template< typename F >
+void CapturePvApi::forEachCache( F fn ) const
+{
+	// the RGB surface cache is among the surface caches
+	if ( mRawCache )
+	{
+		fn( mRawCache );
+	}
+	fn( mChannelCache8u );
+	fn( mChannelCache16u );
+	fn( mSurfaceCache16u );
+	for ( const auto &cache : mSurfaceCaches8u )
+	{
+		fn( cache.second );
+	}
+	for ( const auto &cache : mPreviewCaches )
+	{
+		fn( cache.second );
+	}
+	if ( mMeanCache16u )
+	{
+		fn( mMeanCache16u );
+	}
+	if ( mMeanCache32f )
+	{
+		fn( mMeanCache32f );
+	}
+}
+
 void CapturePvApi::start()
 {
 	if ( mHandle == 0 )
@@ -214,241 +363,1377 @@ void CapturePvApi::start()
 
 	char buffer[ 512 ];
 	CHECK_PVAPI_ERROR( PvAttrEnumGet( mHandle, "PixelFormat", buffer, 512, nullptr ) );
-	std::string pixelFormat( buffer );
-	mPixelFormat = PixelFormat::NOT_SUPPORTED;
-	if ( pixelFormat == "Mono8" )
+	static const std::map< std::string, PixelFormat > sPixelFormats = {
+		{ "Mono8", PixelFormat::MONO8 },
+		{ "Mono16", PixelFormat::MONO16 },
+		{ "Mono12Packed", PixelFormat::MONO12PACKED },
+		{ "Rgb24", PixelFormat::RGB24 },
+		{ "Bayer8", PixelFormat::BAYER8 },
+		{ "Bayer16", PixelFormat::BAYER16 },
+		{ "Bayer12Packed", PixelFormat::BAYER12PACKED },
+		{ "Bgr24", PixelFormat::BGR24 },
+		{ "Rgba32", PixelFormat::RGBA32 },
+		{ "Bgra32", PixelFormat::BGRA32 },
+		{ "Rgb48", PixelFormat::RGB48 },
+		{ "Yuv411", PixelFormat::YUV411 },
+		{ "Yuv422", PixelFormat::YUV422 },
+		{ "Yuv444", PixelFormat::YUV444 }
+	};
+	auto it = sPixelFormats.find( buffer );
+	mPixelFormat = ( it != sPixelFormats.end() ) ? it->second : PixelFormat::NOT_SUPPORTED;
+
+	// the policy and the mode may be changed for the next start() while capturing
+	mActiveDeliveryPolicy = mDeliveryPolicy;
+	mActiveCaptureMode = mActiveDeliveryPolicy == DeliveryPolicy::FIFO_BLOCK ? CaptureMode::WAIT_THREAD : mCaptureMode;
+
+	mFrameQueue.setCapacity( mFrameQueueSize );
+	switch ( mActiveDeliveryPolicy )
+	{
+		case DeliveryPolicy::FIFO_DROP_OLDEST:
+			mFrameQueue.setOverflow( FrameQueueT< Frame >::Overflow::DROP_OLDEST );
+			break;
+
+		case DeliveryPolicy::FIFO_DROP_NEWEST:
+			mFrameQueue.setOverflow( FrameQueueT< Frame >::Overflow::DROP_NEWEST );
+			break;
+
+		default:
+			mFrameQueue.setOverflow( FrameQueueT< Frame >::Overflow::BLOCK );
+			break;
+	}
+	mFrameQueue.open();
+
+	// the queued buffers come from the caches for the formats delivered
+	// without conversion, leave room for the frames held by the consumer and
+	// the conversion jobs
+	size_t numCached = mNumFrameBuffers + 4 + 2 * mNumConversionThreads;
+	if ( mActiveDeliveryPolicy != DeliveryPolicy::LATEST )
 	{
-		mPixelFormat = PixelFormat::MONO8;
+		numCached += mFrameQueueSize;
 	}
-	else
-	if ( pixelFormat == "Mono16" )
+
+	// the caches are rebuilt when the frame buffer options change, frames
+	// still held keep their blocks
+	updateCache( mChannelCache8u, getCacheOptions( mPixelFormat == PixelFormat::MONO8 || mPixelFormat == PixelFormat::BAYER8 ) );
+	updateCache( mChannelCache16u, getCacheOptions( mPixelFormat == PixelFormat::MONO16 || mPixelFormat == PixelFormat::BAYER16 ) );
+	updateCache( mSurfaceCache8u, getCacheOptions( mPixelFormat == PixelFormat::RGB24 ) );
+	mSurfaceCaches8u[ SurfaceChannelOrder::RGB ] = mSurfaceCache8u;
+	updateCache( mSurfaceCache16u, getCacheOptions( mPixelFormat == PixelFormat::RGB48 ) );
+
+	switch ( mPixelFormat )
+	{
+		case PixelFormat::MONO8:
+			mChannelCache8u->reserve( numCached );
+			break;
+
+		case PixelFormat::MONO16:
+			mChannelCache16u->reserve( numCached );
+			break;
+
+		case PixelFormat::RGB24:
+		case PixelFormat::BGR24:
+		case PixelFormat::RGBA32:
+		case PixelFormat::BGRA32:
+		{
+			SurfaceChannelOrder channelOrder = getSurfaceChannelOrder( mPixelFormat );
+			SurfaceCache8uRef &cache = mSurfaceCaches8u[ channelOrder.getCode() ];
+			if ( ! cache )
+			{
+				cache = std::make_shared< SurfaceCache8u >( mSensorWidth, mSensorHeight, channelOrder, 0, getCacheOptions( true ) );
+			}
+			updateCache( cache, getCacheOptions( true ) );
+			cache->reserve( numCached );
+			mCaptureSurfaceCache8u = cache;
+			break;
+		}
+
+		case PixelFormat::RGB48:
+			mSurfaceCache16u->reserve( numCached );
+			break;
+
+		// the mosaic is captured into a channel and interpolated into a surface
+		case PixelFormat::BAYER8:
+			mChannelCache8u->reserve( numCached );
+			mSurfaceCache8u->reserve( numCached );
+			break;
+
+		case PixelFormat::BAYER16:
+			mChannelCache16u->reserve( numCached );
+			mSurfaceCache16u->reserve( numCached );
+			break;
+
+		default:
+		{
+			// raw frames are held by the ring and the conversion jobs
+			size_t numRaw = mNumFrameBuffers + 2 * mNumConversionThreads + 1;
+			if ( ! mRawCache || mRawCache->getWidth() != int32_t( mSensorFrameSize ) || mRawCache->getOptions() != getCacheOptions( true ) )
+			{
+				mRawCache = std::make_shared< ChannelCache8u >( mSensorFrameSize, 1, numRaw, getCacheOptions( true ) );
+			}
+			mRawCache->reserve( numRaw );
+
+			if ( mPixelFormat == PixelFormat::MONO12PACKED || mPixelFormat == PixelFormat::BAYER12PACKED )
+			{
+				mChannelCache16u->reserve( numCached );
+			}
+			if ( mPixelFormat == PixelFormat::MONO12PACKED )
+			{
+				mChannelCache8u->reserve( numCached );
+			}
+			if ( mPixelFormat == PixelFormat::BAYER12PACKED )
+			{
+				mSurfaceCache16u->reserve( numCached );
+			}
+			if ( getYuvFormat( mPixelFormat, nullptr ) )
+			{
+				mSurfaceCache8u->reserve( numCached );
+			}
+			break;
+		}
+	}
+
+	if ( mPreviewScale > 1 )
 	{
-		mPixelFormat = PixelFormat::MONO16;
+		SurfaceCache8uRef &cache = mPreviewCaches[ mPreviewScale ];
+		if ( ! cache )
+		{
+			cache = std::make_shared< SurfaceCache8u >( mSensorWidth / mPreviewScale, mSensorHeight / mPreviewScale, SurfaceChannelOrder::RGB, 0, getCacheOptions( false ) );
+		}
+		updateCache( cache, getCacheOptions( false ) );
+		cache->reserve( numCached );
+		mPreviewCache = cache;
 	}
 	else
-	if ( pixelFormat == "Mono12Packed" )
 	{
-		mPixelFormat = PixelFormat::MONO12PACKED;
+		mPreviewCache.reset();
+	}
+	mPreviewFactor = mPreviewScale;
+
+	// the levels of Mono and Bayer frames are averaged
+	const bool hasLevels = mPixelFormat == PixelFormat::MONO8 || mPixelFormat == PixelFormat::MONO16 ||
+						   mPixelFormat == PixelFormat::MONO12PACKED || mPixelFormat == PixelFormat::BAYER8 ||
+						   mPixelFormat == PixelFormat::BAYER16 || mPixelFormat == PixelFormat::BAYER12PACKED;
+	if ( mAccumulationLength > 1 && hasLevels )
+	{
+		if ( ! mMeanCache16u )
+		{
+			mMeanCache16u = std::make_shared< ChannelCache16u >( mSensorWidth, mSensorHeight, 0, getCacheOptions( false ) );
+		}
+		updateCache( mMeanCache16u, getCacheOptions( false ) );
+		mMeanCache16u->reserve( numCached );
+		if ( mAccumulationFloat )
+		{
+			if ( ! mMeanCache32f )
+			{
+				mMeanCache32f = std::make_shared< ChannelCache32f >( mSensorWidth, mSensorHeight, 0, getCacheOptions( false ) );
+			}
+			updateCache( mMeanCache32f, getCacheOptions( false ) );
+			mMeanCache32f->reserve( numCached );
+		}
+		mAccumulator = std::make_shared< FrameAccumulator >( mSensorWidth, mSensorHeight, mAccumulationLength );
 	}
 	else
-	if ( pixelFormat == "Rgb24" )
 	{
-		mPixelFormat = PixelFormat::RGB24;
+		mAccumulator.reset();
 	}
+	mAccumulationReset = false;
 
-	mThreadShouldQuit = false;
-	mHasNewFrame = false;
-	mThread = std::make_shared< std::thread >( std::bind( &CapturePvApi::threadedFunc, this ) );
+	// the caches grow within the memory limit when frames are held longer than they were sized for
+	forEachCache( [ this ]( const auto &cache ) { cache->setBudget( mPoolBudget ); } );
+
+	if ( ! mStripes || mStripes->getNumThreads() != mNumStripeThreads + 1 )
+	{
+		std::atomic_store( &mStripes, mNumStripeThreads > 0 ? ParallelStripes::create( mNumStripeThreads ) : ParallelStripesRef() );
+	}
+
+	if ( mNumConversionThreads > 0 )
+	{
+		mConversionPool.start( mNumConversionThreads, 2 * mNumConversionThreads );
+	}
+
+	mCaptureShouldQuit = false;
+	mCurrentFrame.clear();
+	mHasSequence = false;
+	resetFrameStats();
+	mClockSync.reset( getAttr( "TimestampFrequency" ) );
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		mCapturing = true;
+	}
+
+	if ( mActiveCaptureMode == CaptureMode::FRAME_CALLBACK )
+	{
+		startCapture();
+	}
+	else
+	{
+		mThread = std::make_shared< std::thread >( std::bind( &CapturePvApi::threadedFunc, this ) );
+	}
 }
 
 void CapturePvApi::stop()
 {
-	std::lock_guard< std::mutex > lock( mMutex );
-	if ( mThread )
+	std::shared_ptr< std::thread > thread;
 	{
-		tPvErr err = PvCaptureQueueClear( mHandle );
-		CHECK_PVAPI_ERROR( err );
+		std::lock_guard< std::mutex > lock( mMutex );
+		if ( ! mCapturing )
+		{
+			return;
+		}
+		mCapturing = false;
+		thread.swap( mThread );
+	}
+
+	// wakes up the capture if it is waiting for the consumer
+	mFrameQueue.close();
+
+	{
+		// no frame is requeued after this point
+		std::lock_guard< std::mutex > lock( mQueueMutex );
+		mCaptureShouldQuit = true;
+	}
+
+	// cancels the queued frames, which wakes up the capture thread
+	tPvErr err = PvCaptureQueueClear( mHandle );
+	CHECK_PVAPI_ERROR( err );
 
-		mThreadShouldQuit = true;
-		mThread->join();
-		mThread.reset();
+	if ( thread )
+	{
+		thread->join();
+	}
+	else
+	{
+		endCapture();
 	}
+
+	mConversionPool.stop();
 }
 
-void CapturePvApi::threadedFunc()
+void CapturePvApi::startCapture()
 {
 	PvCaptureStart( mHandle );
 
-	tPvFrame frame;
-	memset( &frame, 0, sizeof( tPvFrame ) );
-	frame.ImageBufferSize = mSensorFrameSize;
-	frame.ImageBuffer = new uint8_t[ mSensorFrameSize ];
+	// Keep a ring of buffers queued, so the driver always has somewhere to
+	// write while a completed frame is being converted or held by the consumer.
+	mFrameBuffers.clear();
+	mFrameBuffers.resize( mNumFrameBuffers );
+	for ( auto &frameBuffer : mFrameBuffers )
+	{
+		memset( &frameBuffer.mFrame, 0, sizeof( tPvFrame ) );
+		frameBuffer.mFrame.Context[ 0 ] = this;
+		frameBuffer.mFrame.Context[ 1 ] = &frameBuffer;
+		queueFrame( frameBuffer );
+	}
 
-	tPvErr err = PvCaptureQueueFrame( mHandle, &frame, nullptr );
-	CHECK_PVAPI_ERROR( err );
-	err = PvAttrEnumSet( mHandle, "FrameStartTriggerMode", "Freerun" );
+	tPvErr err = PvAttrEnumSet( mHandle, "FrameStartTriggerMode", "Freerun" );
 	CHECK_PVAPI_ERROR( err );
 	err = PvAttrEnumSet( mHandle, "AcquisitionMode", "Continuous" );
 	CHECK_PVAPI_ERROR( err );
-	PvCommandRun( mHandle, "AcquisitionStart" );
+	err = PvCommandRun( mHandle, "AcquisitionStart" );
 	CHECK_PVAPI_ERROR( err );
+}
+
+void CapturePvApi::endCapture()
+{
+	// a frame might have been requeued while stopping
+	PvCaptureQueueClear( mHandle );
+	PvCommandRun( mHandle, "AcquisitionStop" );
+	PvCaptureEnd( mHandle );
+
+	// wait for a frame callback that might still be running
+	std::lock_guard< std::mutex > lock( mQueueMutex );
+	mFrameBuffers.clear();
+}
+
+void CapturePvApi::threadedFunc()
+{
+	startCapture();
 
-	while ( ! mThreadShouldQuit )
+	// frames are completed in the order they are queued
+	size_t current = 0;
+	while ( ! mCaptureShouldQuit )
 	{
-		err = PvCaptureWaitForFrameDone( mHandle, &frame, PVINFINITE );
+		FrameBuffer &frameBuffer = mFrameBuffers[ current ];
+		tPvErr err;
+		{
+			ScopedLatency latency( histogram( Stage::WAIT_FOR_FRAME ) );
+			err = PvCaptureWaitForFrameDone( mHandle, &frameBuffer.mFrame, PVINFINITE );
+		}
 		if ( err != ePvErrSuccess )
 		{
 			CHECK_PVAPI_ERROR( err );
 			continue;
 		}
-		if ( frame.Status == ePvErrSuccess )
-		{
-			switch ( mPixelFormat )
-			{
-				case PixelFormat::MONO8:
-				{
-					std::lock_guard< std::mutex > lock( mMutex );
-					Channel8uRef channel = mChannelCache8u->getNewChannel();
-					memcpy( channel->getData(), frame.ImageBuffer, frame.ImageBufferSize );
-					mCurrentChannel8u = channel;
-					mHasNewFrame = true;
-					break;
-				}
+		current = ( current + 1 ) % mFrameBuffers.size();
 
-				case PixelFormat::MONO16:
-				{
-					std::lock_guard< std::mutex > lock( mMutex );
-					Channel16uRef channel = mChannelCache16u->getNewChannel();
-					memcpy( channel->getData(), frame.ImageBuffer, frame.ImageBufferSize );
-					mCurrentChannel16u = channel;
-					mHasNewFrame = true;
-					break;
-				}
+		frameDone( frameBuffer );
+	}
 
-				case PixelFormat::MONO12PACKED:
-				{
-					Channel16uRef channel = mChannelCache16u->getNewChannel();
-					uint16_t *dst = channel->getData();
-					uint8_t *src = static_cast< uint8_t * >( frame.ImageBuffer );
-					size_t n = channel->getWidth() * channel->getHeight();
-					for ( size_t i = 0; i < n / 2; i++, dst += 2, src += 3 )
-					{
-						uint16_t p0 = src[ 0 ];
-						uint16_t p01 = src[ 1 ];
-						uint16_t p1 = src[ 2 ];
-						dst[ 0 ] = ( p0 << 4 ) | (( p01 & 0xf0 ) >> 4 );
-						dst[ 1 ] = ( ( p01 & 0xf ) << 8 ) | p1;
-					}
-					mCurrentChannel16u = channel;
-					mHasNewFrame = true;
-					break;
-				}
+	endCapture();
+}
 
-				case PixelFormat::RGB24:
-				{
-					std::lock_guard< std::mutex > lock( mMutex );
-					Surface8uRef surface = mSurfaceCache8u->getNewSurface();
-					memcpy( surface->getData(), frame.ImageBuffer, frame.ImageBufferSize );
-					mCurrentSurface8u = surface;
-					mHasNewFrame = true;
-					break;
-				}
+// static
+void PVDECL CapturePvApi::frameDoneCallback( tPvFrame *frame )
+{
+	CapturePvApi *capture = static_cast< CapturePvApi * >( frame->Context[ 0 ] );
+	FrameBuffer *frameBuffer = static_cast< FrameBuffer * >( frame->Context[ 1 ] );
+	capture->frameDone( *frameBuffer );
+}
+
+void CapturePvApi::frameDone( FrameBuffer &frameBuffer )
+{
+	// the arrival time of a complete frame is the host side of the clock sync
+	// sample, the latency histograms reuse it and add no clock reads of their
+	// own when MNDL_PVAPI_LATENCY_HISTOGRAMS is 0
+	if ( frameBuffer.mFrame.Status == ePvErrSuccess )
+	{
+		frameBuffer.mArrivalTime = ClockSync::Clock::now();
+	}
+
+	std::unique_lock< std::mutex > lock( mQueueMutex );
+	if ( mCaptureShouldQuit )
+	{
+		return;
+	}
+
+	if ( frameBuffer.mFrame.Status == ePvErrSuccess )
+	{
+		updateSequence( frameBuffer.mFrame );
+		mClockSync.addSample( getTimestamp( frameBuffer.mFrame ), frameBuffer.mArrivalTime );
 
-				default:
-					break;
+		Frame frame;
+		stampFrame( frameBuffer, frame );
+		if ( mActiveCaptureMode == CaptureMode::WAIT_THREAD )
+		{
+			// the capture thread is the only one picking up frames, so it
+			// converts and publishes without the lock and may wait for the
+			// consumer there. Frame callbacks might run concurrently and
+			// never wait.
+			lock.unlock();
+			processFrame( frameBuffer, frame );
+			lock.lock();
+			if ( mCaptureShouldQuit )
+			{
+				return;
 			}
 		}
 		else
 		{
-			CHECK_PVAPI_ERROR( frame.Status );
-		}
-
-		if ( ! mThreadShouldQuit )
-		{
-			err = PvCaptureQueueFrame( mHandle, &frame, nullptr );
-			CHECK_PVAPI_ERROR( err );
+			processFrame( frameBuffer, frame );
 		}
 	}
+	else
+	if ( frameBuffer.mFrame.Status != ePvErrCancelled )
+	{
+		// the frame counter of an incomplete frame is still valid, so it is
+		// not counted again as a missing one
+		updateSequence( frameBuffer.mFrame );
+		mNumFramesFailed.fetch_add( 1, std::memory_order_relaxed );
+		CHECK_PVAPI_ERROR( frameBuffer.mFrame.Status );
+	}
 
-	PvCommandRun( mHandle, "AcquisitionStop" );
-	PvCaptureEnd( mHandle );
-
-	delete [] static_cast< uint8_t * >( frame.ImageBuffer );
-}
-
-bool CapturePvApi::checkNewFrame() const
-{
-	std::lock_guard< std::mutex > lock( mMutex );
-	return mHasNewFrame;
+	queueFrame( frameBuffer );
 }
 
-Channel8uRef CapturePvApi::getChannel() const
+void CapturePvApi::updateSequence( const tPvFrame &pvFrame )
 {
-	std::lock_guard< std::mutex > lock( mMutex );
-	mHasNewFrame = false;
-	switch ( mPixelFormat )
+	// FrameCount is the 16-bit GigE Vision block id, which skips the
+	// reserved id 0 when it rolls over
+	uint32_t frameCount = pvFrame.FrameCount & 0xffff;
+	if ( mHasSequence )
 	{
-		case PixelFormat::MONO8:
-			return mCurrentChannel8u;
-			break;
-
-		case PixelFormat::MONO16:
-		case PixelFormat::MONO12PACKED:
+		uint32_t delta = ( frameCount - mLastFrameCount ) & 0xffff;
+		if ( frameCount < mLastFrameCount && delta > 1 )
 		{
-			return Channel8u::create( *mCurrentChannel16u );
-			break;
+			delta--;
 		}
-
-		case PixelFormat::RGB24:
+		if ( delta > 1 )
 		{
-			return Channel8u::create( *mCurrentSurface8u );
-			break;
+			mNumFramesMissing.fetch_add( delta - 1, std::memory_order_relaxed );
 		}
-
-		default:
-			return Channel8uRef();
-			break;
+		mSequenceNumber += delta;
+	}
+	else
+	{
+		mHasSequence = true;
+		mSequenceNumber = 0;
 	}
+	mLastFrameCount = frameCount;
 }
 
-Channel8uRef CapturePvApi::getChannel8u() const
+// static
+uint64_t CapturePvApi::getTimestamp( const tPvFrame &pvFrame )
 {
-	return getChannel();
+	return ( uint64_t( pvFrame.TimestampHi ) << 32 ) | uint32_t( pvFrame.TimestampLo );
 }
 
-Channel16uRef CapturePvApi::getChannel16u() const
+void CapturePvApi::queueFrame( FrameBuffer &frameBuffer )
 {
-	std::lock_guard< std::mutex > lock( mMutex );
-	mHasNewFrame = false;
-	switch ( mPixelFormat )
+	tPvFrame &frame = frameBuffer.mFrame;
+
+	// Raw formats are captured straight into a cached block, which is handed
+	// to the consumer as is. The block goes back to the cache when its last
+	// reference is released and is queued again from there.
+	if ( ! frameBuffer.mData )
 	{
-		case PixelFormat::MONO8:
-			return Channel16u::create( *mCurrentChannel8u );
-			break;
+		ScopedLatency latency( histogram( Stage::POOL_ACQUIRE ) );
+		switch ( mPixelFormat )
+		{
+			case PixelFormat::MONO8:
+			case PixelFormat::BAYER8:
+			{
+				Channel8uRef channel = mChannelCache8u->getNewChannel();
+				frame.ImageBuffer = channel->getData();
+				frame.ImageBufferSize = channel->getRowBytes() * channel->getHeight();
+				frameBuffer.mData = channel;
+				break;
+			}
 
-		case PixelFormat::MONO16:
-		case PixelFormat::MONO12PACKED:
-			return mCurrentChannel16u;
-			break;
+			case PixelFormat::MONO16:
+			case PixelFormat::BAYER16:
+			{
+				Channel16uRef channel = mChannelCache16u->getNewChannel();
+				frame.ImageBuffer = channel->getData();
+				frame.ImageBufferSize = channel->getRowBytes() * channel->getHeight();
+				frameBuffer.mData = channel;
+				break;
+			}
 
-		case PixelFormat::RGB24:
-			return Channel16u::create( *mCurrentSurface8u );
-			break;
+			case PixelFormat::RGB24:
+			case PixelFormat::BGR24:
+			case PixelFormat::RGBA32:
+			case PixelFormat::BGRA32:
+			{
+				Surface8uRef surface = mCaptureSurfaceCache8u->getNewSurface();
+				frame.ImageBuffer = surface->getData();
+				frame.ImageBufferSize = surface->getRowBytes() * surface->getHeight();
+				frameBuffer.mData = surface;
+				break;
+			}
 
-		default:
-			return Channel16uRef();
-			break;
+			case PixelFormat::RGB48:
+			{
+				Surface16uRef surface = mSurfaceCache16u->getNewSurface();
+				frame.ImageBuffer = surface->getData();
+				frame.ImageBufferSize = surface->getRowBytes() * surface->getHeight();
+				frameBuffer.mData = surface;
+				break;
+			}
+
+			default:
+			{
+				// formats which need conversion are captured into a raw
+				// block, which is handed to the conversion
+				Channel8uRef raw = mRawCache->getNewChannel();
+				frame.ImageBuffer = raw->getData();
+				frame.ImageBufferSize = mSensorFrameSize;
+				frameBuffer.mData = raw;
+				break;
+			}
+		}
 	}
+
+	tPvErr err = PvCaptureQueueFrame( mHandle, &frame,
+			mActiveCaptureMode == CaptureMode::FRAME_CALLBACK ? frameDoneCallback : nullptr );
+	CHECK_PVAPI_ERROR( err );
 }
 
-Surface8uRef CapturePvApi::getSurface() const
+void CapturePvApi::stampFrame( const FrameBuffer &frameBuffer, Frame &frame )
+{
+	const tPvFrame &pvFrame = frameBuffer.mFrame;
+	frame.mPixelFormat = mPixelFormat;
+	frame.mTimestamp = getTimestamp( pvFrame );
+	frame.mHostTimestamp = mClockSync.toHostTime( frame.mTimestamp );
+	frame.mFrameCount = pvFrame.FrameCount;
+	frame.mSequenceNumber = mSequenceNumber;
+	frame.mRoi = Area( pvFrame.RegionX, pvFrame.RegionY,
+			pvFrame.RegionX + pvFrame.Width, pvFrame.RegionY + pvFrame.Height );
+	frame.mBitDepth = pvFrame.BitDepth;
+	frame.mBayerPattern = pvFrame.BayerPattern;
+	frame.mArrivalTime = frameBuffer.mArrivalTime;
+	frame.mConversions = std::make_shared< Frame::Conversions >();
+}
+
+void CapturePvApi::processFrame( FrameBuffer &frameBuffer, Frame &frame )
 {
-	std::lock_guard< std::mutex > lock( mMutex );
-	mHasNewFrame = false;
 	switch ( mPixelFormat )
 	{
 		case PixelFormat::MONO8:
-			return Surface8u::create( *mCurrentChannel8u );
+		case PixelFormat::MONO16:
+		case PixelFormat::RGB24:
+		case PixelFormat::BGR24:
+		case PixelFormat::RGBA32:
+		case PixelFormat::BGRA32:
+		case PixelFormat::RGB48:
+			if ( needsConversion() )
+			{
+				// measured and downscaled on the conversion threads
+				submitConversion( frameBuffer, frame );
+			}
+			else
+			{
+				takeCapturedPixels( frameBuffer, frame );
+				publishFrame( frame );
+			}
 			break;
 
-		case PixelFormat::MONO16:
 		case PixelFormat::MONO12PACKED:
-			return Surface8u::create( *mCurrentChannel16u );
+		case PixelFormat::BAYER8:
+		case PixelFormat::BAYER16:
+		case PixelFormat::BAYER12PACKED:
+		case PixelFormat::YUV411:
+		case PixelFormat::YUV422:
+		case PixelFormat::YUV444:
+			submitConversion( frameBuffer, frame );
+			break;
+
+		default:
+			break;
+	}
+}
+
+bool CapturePvApi::takeCapturedPixels( FrameBuffer &frameBuffer, Frame &frame ) const
+{
+	switch ( mPixelFormat )
+	{
+		case PixelFormat::MONO8:
+		case PixelFormat::BAYER8:
+			frame.mChannel8u = std::static_pointer_cast< Channel8u >( frameBuffer.mData );
+			break;
+
+		case PixelFormat::MONO16:
+		case PixelFormat::BAYER16:
+			frame.mChannel16u = std::static_pointer_cast< Channel16u >( frameBuffer.mData );
 			break;
 
 		case PixelFormat::RGB24:
-			return mCurrentSurface8u;
+		case PixelFormat::BGR24:
+		case PixelFormat::RGBA32:
+		case PixelFormat::BGRA32:
+			frame.mSurface8u = std::static_pointer_cast< Surface8u >( frameBuffer.mData );
+			break;
+
+		case PixelFormat::RGB48:
+			frame.mSurface16u = std::static_pointer_cast< Surface16u >( frameBuffer.mData );
 			break;
 
 		default:
-			return Surface8uRef();
+			return false;
+	}
+	frameBuffer.mData.reset();
+	return true;
+}
+
+void CapturePvApi::submitConversion( FrameBuffer &frameBuffer, Frame &frame )
+{
+	// the captured block moves to the conversion, the ring gets a new one
+	ConversionJob job;
+	job.mFrame = std::move( frame );
+	if ( ! takeCapturedPixels( frameBuffer, job.mFrame ) )
+	{
+		job.mRaw = std::static_pointer_cast< Channel8u >( frameBuffer.mData );
+		frameBuffer.mData.reset();
+	}
+
+	if ( mConversionPool.isRunning() )
+	{
+		// the conversion waits instead of dropping frames when the consumer falls behind with FIFO_BLOCK
+		if ( ! mConversionPool.submit( std::move( job ), mActiveDeliveryPolicy == DeliveryPolicy::FIFO_BLOCK ) )
+		{
+			mNumFramesSkipped.fetch_add( 1, std::memory_order_relaxed );
+		}
+	}
+	else
+	{
+		convertFrame( job );
+		accumulateFrame( job.mFrame );
+		publishFrame( job.mFrame );
+	}
+}
+
+std::shared_ptr< FrameStatistics > CapturePvApi::createStatistics( const Frame &frame ) const
+{
+	const uint32_t levelBits = getLevelBits( frame );
+	if ( ! mStatisticsEnabled || levelBits == 0 )
+	{
+		return std::shared_ptr< FrameStatistics >();
+	}
+	return std::make_shared< FrameStatistics >( levelBits );
+}
+
+FlatFieldCorrectionRef CapturePvApi::getCorrection( const Frame &frame ) const
+{
+	if ( ! mCorrectionEnabled )
+	{
+		return FlatFieldCorrectionRef();
+	}
+
+	FlatFieldCorrectionRef correction = std::atomic_load( &mCorrection );
+	if ( ! correction || correction->getWidth() != frame.getWidth() || correction->getHeight() != frame.getHeight() ||
+		 correction->getBitDepth() != getLevelBits( frame ) )
+	{
+		return FlatFieldCorrectionRef();
+	}
+	return correction;
+}
+
+void CapturePvApi::setCorrection( const FlatFieldCorrectionRef &correction )
+{
+	std::atomic_store( &mCorrection, correction );
+}
+
+bool CapturePvApi::saveCorrection( const fs::path &path ) const
+{
+	FlatFieldCorrectionRef correction = getCorrection();
+	return correction && correction->save( path );
+}
+
+bool CapturePvApi::loadCorrection( const fs::path &path )
+{
+	FlatFieldCorrectionRef correction = FlatFieldCorrection::load( path );
+	if ( ! correction )
+	{
+		return false;
+	}
+	setCorrection( correction );
+	return true;
+}
+
+void CapturePvApi::calibrateDark( size_t numFrames )
+{
+	std::lock_guard< std::mutex > lock( mCalibrationMutex );
+	mCalibration.reset( new Calibration() );
+	mCalibration->mNumFrames = std::min( std::max< size_t >( numFrames, 1 ), kMaxCalibrationFrames );
+	mCalibrating = true;
+}
+
+void CapturePvApi::calibrateFlat( size_t numFrames )
+{
+	std::lock_guard< std::mutex > lock( mCalibrationMutex );
+	mCalibration.reset( new Calibration() );
+	mCalibration->mFlat = true;
+	mCalibration->mNumFrames = std::min( std::max< size_t >( numFrames, 1 ), kMaxCalibrationFrames );
+	mCalibrating = true;
+}
+
+template< typename T >
+void CapturePvApi::addCalibrationFrame( const ChannelT< T > &channel, const Frame &frame )
+{
+	std::lock_guard< std::mutex > lock( mCalibrationMutex );
+	if ( ! mCalibration )
+	{
+		return;
+	}
+
+	Calibration &calibration = *mCalibration;
+	const size_t width = channel.getWidth();
+	const size_t height = channel.getHeight();
+	if ( calibration.mSums.empty() )
+	{
+		calibration.mSums.assign( width * height, 0 );
+		calibration.mWidth = int32_t( width );
+		calibration.mHeight = int32_t( height );
+		calibration.mBitDepth = getLevelBits( frame );
+	}
+	else
+	if ( calibration.mWidth != int32_t( width ) || calibration.mHeight != int32_t( height ) || calibration.mBitDepth != getLevelBits( frame ) )
+	{
+		return;
+	}
+
+	for ( size_t y = 0; y < height; y++ )
+	{
+		const T *row = reinterpret_cast< const T * >( reinterpret_cast< const uint8_t * >( channel.getData() ) + y * channel.getRowBytes() );
+		uint32_t *sums = calibration.mSums.data() + y * width;
+		for ( size_t x = 0; x < width; x++ )
+		{
+			sums[ x ] += row[ x ];
+		}
+	}
+
+	if ( ++calibration.mNumAdded < calibration.mNumFrames )
+	{
+		return;
+	}
+
+	// the other map of the current correction is kept if it fits
+	FlatFieldCorrectionRef current = std::atomic_load( &mCorrection );
+	std::shared_ptr< FlatFieldCorrection > correction;
+	if ( current && current->getWidth() == calibration.mWidth && current->getHeight() == calibration.mHeight &&
+		 current->getBitDepth() == calibration.mBitDepth )
+	{
+		correction = std::make_shared< FlatFieldCorrection >( *current );
+	}
+	else
+	{
+		correction = std::make_shared< FlatFieldCorrection >( calibration.mWidth, calibration.mHeight, calibration.mBitDepth );
+	}
+
+	if ( calibration.mFlat )
+	{
+		const bool mosaic = frame.mPixelFormat == PixelFormat::BAYER8 || frame.mPixelFormat == PixelFormat::BAYER16 ||
+							frame.mPixelFormat == PixelFormat::BAYER12PACKED;
+		correction->setGainFromSums( calibration.mSums, calibration.mNumAdded, mosaic );
+	}
+	else
+	{
+		correction->setDarkFromSums( calibration.mSums, calibration.mNumAdded );
+	}
+	std::atomic_store( &mCorrection, FlatFieldCorrectionRef( correction ) );
+
+	mCalibration.reset();
+	mCalibrating = false;
+}
+
+template< typename T >
+void CapturePvApi::correctLevels( ChannelT< T > &channel, Frame &frame, FrameStatistics *stats )
+{
+	if ( mCalibrating )
+	{
+		addCalibrationFrame( channel, frame );
+	}
+
+	const FlatFieldCorrectionRef correction = getCorrection( frame );
+	if ( correction )
+	{
+		correction->apply( &channel, stats, mStripes.get() );
+		frame.mCorrected = true;
+	}
+	else
+	if ( stats )
+	{
+		computeStatistics( channel, stats, mStripes.get() );
+	}
+}
+
+void CapturePvApi::convertFrame( ConversionJob &job )
+{
+	const std::shared_ptr< FrameStatistics > stats = createStatistics( job.mFrame );
+	job.mFrame.mStatistics = stats;
+
+	switch ( mPixelFormat )
+	{
+		case PixelFormat::MONO8:
+		{
+			ScopedLatency latency( histogram( Stage::CONVERT ) );
+			correctLevels( *job.mFrame.mChannel8u, job.mFrame, stats.get() );
+			break;
+		}
+
+		case PixelFormat::MONO16:
+		{
+			ScopedLatency latency( histogram( Stage::CONVERT ) );
+			correctLevels( *job.mFrame.mChannel16u, job.mFrame, stats.get() );
+			break;
+		}
+
+		case PixelFormat::MONO12PACKED:
+		{
+			// the levels are corrected, measured and mapped to 8 bits with the
+			// window or the tone curve in the same pass, unless they are needed
+			// uncorrected for a calibration
+			const bool calibrating = mCalibrating;
+			const FlatFieldCorrectionRef correction = getCorrection( job.mFrame );
+			const LevelMapping mapping = getLevelMapping( job.mFrame );
+			Channel16uRef channel;
+			Channel8uRef channel8u;
+			{
+				ScopedLatency latency( histogram( Stage::POOL_ACQUIRE ) );
+				channel = mChannelCache16u->getNewChannel();
+				if ( ! calibrating )
+				{
+					channel8u = mChannelCache8u->getNewChannel();
+				}
+			}
+
+			{
+				ScopedLatency latency( histogram( Stage::CONVERT ) );
+				if ( calibrating )
+				{
+					unpackMono12Packed( job.mRaw->getData(), channel.get(), mStripes.get() );
+					correctLevels( *channel, job.mFrame, stats.get() );
+				}
+				else
+				{
+					unpackMono12Packed( job.mRaw->getData(), channel.get(), channel8u.get(), mapping, correction.get(), stats.get(), mStripes.get() );
+					job.mFrame.mCorrected = bool( correction );
+				}
+				if ( channel8u )
+				{
+					job.mFrame.mConversions->mChannel8u = channel8u;
+					job.mFrame.mConversions->mChannel8uMapping = mapping;
+				}
+			}
+			job.mFrame.mChannel16u = channel;
+			break;
+		}
+
+		case PixelFormat::BAYER8:
+		{
+			Surface8uRef surface;
+			{
+				ScopedLatency latency( histogram( Stage::POOL_ACQUIRE ) );
+				surface = mSurfaceCache8u->getNewSurface();
+			}
+
+			{
+				ScopedLatency latency( histogram( Stage::CONVERT ) );
+				correctLevels( *job.mFrame.mChannel8u, job.mFrame, stats.get() );
+				demosaic( *job.mFrame.mChannel8u, BayerPattern( job.mFrame.mBayerPattern ), mDemosaicMethod, surface.get(), mStripes.get() );
+			}
+			job.mFrame.mSurface8u = surface;
+			break;
+		}
+
+		case PixelFormat::BAYER16:
+		{
+			Surface16uRef surface;
+			{
+				ScopedLatency latency( histogram( Stage::POOL_ACQUIRE ) );
+				surface = mSurfaceCache16u->getNewSurface();
+			}
+
+			{
+				ScopedLatency latency( histogram( Stage::CONVERT ) );
+				correctLevels( *job.mFrame.mChannel16u, job.mFrame, stats.get() );
+				demosaic( *job.mFrame.mChannel16u, BayerPattern( job.mFrame.mBayerPattern ), mDemosaicMethod, surface.get(), mStripes.get() );
+			}
+			job.mFrame.mSurface16u = surface;
+			break;
+		}
+
+		case PixelFormat::BAYER12PACKED:
+		{
+			Channel16uRef channel;
+			Surface16uRef surface;
+			{
+				ScopedLatency latency( histogram( Stage::POOL_ACQUIRE ) );
+				channel = mChannelCache16u->getNewChannel();
+				surface = mSurfaceCache16u->getNewSurface();
+			}
+
+			{
+				ScopedLatency latency( histogram( Stage::CONVERT ) );
+				const FlatFieldCorrectionRef correction = getCorrection( job.mFrame );
+				if ( mCalibrating )
+				{
+					unpackMono12Packed( job.mRaw->getData(), channel.get(), mStripes.get() );
+					correctLevels( *channel, job.mFrame, stats.get() );
+				}
+				else
+				if ( correction || stats )
+				{
+					unpackMono12Packed( job.mRaw->getData(), channel.get(), nullptr, LevelMapping(), correction.get(), stats.get(), mStripes.get() );
+					job.mFrame.mCorrected = bool( correction );
+				}
+				else
+				{
+					unpackMono12Packed( job.mRaw->getData(), channel.get(), mStripes.get() );
+				}
+				demosaic( *channel, BayerPattern( job.mFrame.mBayerPattern ), mDemosaicMethod, surface.get(), mStripes.get() );
+			}
+			job.mFrame.mChannel16u = channel;
+			job.mFrame.mSurface16u = surface;
+			break;
+		}
+
+		case PixelFormat::YUV411:
+		case PixelFormat::YUV422:
+		case PixelFormat::YUV444:
+		{
+			Surface8uRef surface;
+			{
+				ScopedLatency latency( histogram( Stage::POOL_ACQUIRE ) );
+				surface = mSurfaceCache8u->getNewSurface();
+			}
+
+			{
+				ScopedLatency latency( histogram( Stage::CONVERT ) );
+				YuvFormat yuvFormat;
+				getYuvFormat( mPixelFormat, &yuvFormat );
+				convertYuvToRgb( job.mRaw->getData(), yuvFormat, surface.get(), mStripes.get() );
+			}
+			job.mFrame.mSurface8u = surface;
 			break;
+		}
+
+		default:
+			break;
+	}
+
+	// the raw block can be queued again
+	job.mRaw.reset();
+
+	if ( mPreviewCache )
+	{
+		Surface8uRef preview;
+		{
+			ScopedLatency latency( histogram( Stage::POOL_ACQUIRE ) );
+			preview = mPreviewCache->getNewSurface();
+		}
+
+		// downscaled from the colors if there are any
+		ScopedLatency latency( histogram( Stage::CONVERT ) );
+		const Frame &frame = job.mFrame;
+		if ( frame.mSurface8u )
+		{
+			downscale( *frame.mSurface8u, mPreviewFactor, preview.get(), mStripes.get() );
+		}
+		else
+		if ( frame.mSurface16u )
+		{
+			downscale( *frame.mSurface16u, mPreviewFactor, getLevelMapping( frame ), preview.get(), mStripes.get() );
+		}
+		else
+		if ( frame.mChannel8u )
+		{
+			downscale( *frame.mChannel8u, mPreviewFactor, preview.get(), mStripes.get() );
+		}
+		else
+		if ( frame.mChannel16u )
+		{
+			downscale( *frame.mChannel16u, mPreviewFactor, getLevelMapping( frame ), preview.get(), mStripes.get() );
+		}
+		job.mFrame.mPreview = preview;
 	}
 }
 
+void CapturePvApi::accumulateFrame( Frame &frame )
+{
+	if ( ! mAccumulator || ( ! frame.mChannel8u && ! frame.mChannel16u ) )
+	{
+		return;
+	}
+
+	Channel16uRef mean16u;
+	Channel32fRef mean32f;
+	{
+		ScopedLatency latency( histogram( Stage::POOL_ACQUIRE ) );
+		mean16u = mMeanCache16u->getNewChannel();
+		if ( mAccumulationFloat )
+		{
+			mean32f = mMeanCache32f->getNewChannel();
+		}
+	}
+
+	// the publish step runs one job at a time in submission order, so the
+	// rolling sum of frame N holds exactly the frames up to N and the history
+	// slot subtracted is always the oldest frame
+	ScopedLatency latency( histogram( Stage::CONVERT ) );
+	if ( mAccumulationReset.exchange( false ) )
+	{
+		mAccumulator->reset();
+	}
+	if ( frame.mChannel16u )
+	{
+		mAccumulator->add( *frame.mChannel16u, mean16u.get(), mean32f.get(), mStripes.get() );
+	}
+	else
+	{
+		mAccumulator->add( *frame.mChannel8u, mean16u.get(), mean32f.get(), mStripes.get() );
+	}
+	frame.mMean16u = mean16u;
+	frame.mMean32f = mean32f;
+	frame.mNumAveraged = mAccumulator->getNumAccumulated();
+}
+
+bool CapturePvApi::checkNewFrame() const
+{
+	return mCurrentFrame.hasNew();
+}
+
+void CapturePvApi::publishFrame( Frame &frame )
+{
+	ScopedLatency latency( histogram( Stage::PUBLISH ) );
+
+	if ( mActiveDeliveryPolicy == DeliveryPolicy::LATEST )
+	{
+		if ( mCurrentFrame.publish( std::move( frame ) ) )
+		{
+			mNumFramesOverwritten.fetch_add( 1, std::memory_order_relaxed );
+		}
+	}
+	else
+	{
+		// the latest frame is still available for previews
+		mCurrentFrame.publish( frame );
+		if ( ! mFrameQueue.push( std::move( frame ) ) )
+		{
+			return;
+		}
+	}
+	mNumFramesDelivered.fetch_add( 1, std::memory_order_relaxed );
+}
+
+bool CapturePvApi::popFrame( Frame *frame, std::chrono::milliseconds timeout )
+{
+	return mFrameQueue.pop( *frame, timeout );
+}
+
+CapturePvApi::FrameStats CapturePvApi::getFrameStats() const
+{
+	FrameStats stats;
+	stats.numFramesDelivered = mNumFramesDelivered.load( std::memory_order_relaxed );
+	stats.numFramesFailed = mNumFramesFailed.load( std::memory_order_relaxed );
+	stats.numFramesMissing = mNumFramesMissing.load( std::memory_order_relaxed );
+	stats.numFramesSkipped = mNumFramesSkipped.load( std::memory_order_relaxed );
+	stats.numFramesOverwritten = mNumFramesOverwritten.load( std::memory_order_relaxed );
+	stats.numFramesBlocked = mFrameQueue.getNumBlocked();
+	stats.numFramesDroppedOldest = mFrameQueue.getNumDroppedOldest();
+	stats.numFramesDroppedNewest = mFrameQueue.getNumDroppedNewest();
+	return stats;
+}
+
+void CapturePvApi::resetFrameStats()
+{
+	mNumFramesDelivered = 0;
+	mNumFramesFailed = 0;
+	mNumFramesMissing = 0;
+	mNumFramesSkipped = 0;
+	mNumFramesOverwritten = 0;
+	mFrameQueue.resetCounters();
+}
+
+CapturePvApi::Frame CapturePvApi::fetchFrame() const
+{
+#if MNDL_PVAPI_LATENCY_HISTOGRAMS
+	bool isNew;
+	Frame frame = mCurrentFrame.fetch( &isNew );
+	if ( isNew )
+	{
+		mLatencyHistograms[ size_t( Stage::CONSUMER_PICKUP ) ].add( LatencyHistogram::Clock::now() - frame.mArrivalTime );
+	}
+	return frame;
+#else
+	return mCurrentFrame.fetch();
+#endif
+}
+
+PoolStats CapturePvApi::getPoolStats() const
+{
+	PoolStats stats;
+	forEachCache( [ &stats ]( const auto &cache ) { stats += cache->getStats(); } );
+	return stats;
+}
+
+void CapturePvApi::resetPoolStats()
+{
+	forEachCache( []( const auto &cache ) { cache->resetStats(); } );
+}
+
+void CapturePvApi::resetLatencyHistograms()
+{
+	for ( auto &histogram : mLatencyHistograms )
+	{
+		histogram.reset();
+	}
+}
+
+CapturePvApi::Frame CapturePvApi::getFrame() const
+{
+	return fetchFrame();
+}
+
+Channel8uRef CapturePvApi::getChannel() const
+{
+	return getChannel8u( fetchFrame() );
+}
+
+Channel8uRef CapturePvApi::getChannel8u() const
+{
+	return getChannel8u( fetchFrame() );
+}
+
+Channel16uRef CapturePvApi::getChannel16u() const
+{
+	return getChannel16u( fetchFrame() );
+}
+
+Surface8uRef CapturePvApi::getSurface() const
+{
+	return getSurface8u( fetchFrame() );
+}
+
 Surface8uRef CapturePvApi::getSurface8u() const
 {
-	return getSurface();
+	return getSurface8u( fetchFrame() );
+}
+
+Surface8uRef CapturePvApi::getPreview() const
+{
+	return fetchFrame().mPreview;
+}
+
+Channel16uRef CapturePvApi::getMean16u() const
+{
+	return fetchFrame().mMean16u;
+}
+
+Channel32fRef CapturePvApi::getMean32f() const
+{
+	return fetchFrame().mMean32f;
+}
+
+Surface16uRef CapturePvApi::getSurface16u() const
+{
+	return fetchFrame().mSurface16u;
+}
+
+// The derived representations are taken from the color pixels of a frame if
+// it has them, otherwise from its mono pixels.
+
+Channel8uRef CapturePvApi::getChannel8u( const Frame &frame ) const
+{
+	if ( frame.mChannel8u && ! frame.mSurface8u )
+	{
+		return frame.mChannel8u;
+	}
+	if ( ! frame.mConversions )
+	{
+		return Channel8uRef();
+	}
+
+	Frame::Conversions &conversions = *frame.mConversions;
+	std::lock_guard< std::mutex > lock( conversions.mMutex );
+	const bool windowed = frame.mSurface16u || frame.mChannel16u;
+	const LevelMapping mapping = windowed ? getLevelMapping( frame ) : LevelMapping();
+	if ( ! conversions.mChannel8u || conversions.mChannel8uMapping != mapping )
+	{
+		if ( frame.mSurface16u )
+		{
+			conversions.mChannel8u = getConvertedChannel8u( *getDerivedChannel16u( frame ), mapping );
+		}
+		else
+		if ( frame.mSurface8u )
+		{
+			conversions.mChannel8u = Channel8u::create( *frame.mSurface8u );
+		}
+		else
+		if ( frame.mChannel16u )
+		{
+			conversions.mChannel8u = getConvertedChannel8u( *frame.mChannel16u, mapping );
+		}
+		conversions.mChannel8uMapping = mapping;
+	}
+	return conversions.mChannel8u;
+}
+
+Channel16uRef CapturePvApi::getChannel16u( const Frame &frame ) const
+{
+	if ( frame.mChannel16u && ! frame.mSurface16u )
+	{
+		return frame.mChannel16u;
+	}
+	if ( ! frame.mConversions )
+	{
+		return Channel16uRef();
+	}
+
+	std::lock_guard< std::mutex > lock( frame.mConversions->mMutex );
+	return getDerivedChannel16u( frame );
+}
+
+const Channel16uRef & CapturePvApi::getDerivedChannel16u( const Frame &frame ) const
+{
+	Frame::Conversions &conversions = *frame.mConversions;
+	if ( ! conversions.mChannel16u )
+	{
+		if ( frame.mSurface16u )
+		{
+			conversions.mChannel16u = Channel16u::create( *frame.mSurface16u );
+		}
+		else
+		if ( frame.mSurface8u )
+		{
+			conversions.mChannel16u = Channel16u::create( *frame.mSurface8u );
+		}
+		else
+		if ( frame.mChannel8u )
+		{
+			conversions.mChannel16u = Channel16u::create( *frame.mChannel8u );
+		}
+	}
+	return conversions.mChannel16u;
+}
+
+Surface8uRef CapturePvApi::getSurface8u( const Frame &frame ) const
+{
+	if ( frame.mSurface8u )
+	{
+		return frame.mSurface8u;
+	}
+	if ( ! frame.mConversions )
+	{
+		return Surface8uRef();
+	}
+
+	Frame::Conversions &conversions = *frame.mConversions;
+	std::lock_guard< std::mutex > lock( conversions.mMutex );
+	const bool windowed = frame.mSurface16u || frame.mChannel16u;
+	const LevelMapping mapping = windowed ? getLevelMapping( frame ) : LevelMapping();
+	if ( ! conversions.mSurface8u || conversions.mSurface8uMapping != mapping )
+	{
+		conversions.mSurface8u = getConvertedSurface8u( frame, mapping );
+		conversions.mSurface8uMapping = mapping;
+	}
+	return conversions.mSurface8u;
+}
+
+// static
+template< typename T >
+bool CapturePvApi::hasSize( const Frame &frame, const T &dst )
+{
+	return frame && dst.getWidth() == frame.getWidth() && dst.getHeight() == frame.getHeight();
+}
+
+bool CapturePvApi::copyInto( const Frame &frame, Channel8u &dst ) const
+{
+	if ( ! hasSize( frame, dst ) )
+	{
+		return false;
+	}
+
+	ParallelStripesRef stripes = std::atomic_load( &mStripes );
+	const LevelMapping mapping = getLevelMapping( frame );
+	if ( frame.mSurface16u )
+	{
+		convert16uTo8u( *frame.mSurface16u, &dst, mapping, stripes.get() );
+	}
+	else
+	if ( frame.mSurface8u )
+	{
+		ip::grayscale( *frame.mSurface8u, &dst );
+	}
+	else
+	if ( frame.mChannel16u )
+	{
+		convert16uTo8u( *frame.mChannel16u, &dst, mapping, stripes.get() );
+	}
+	else
+	{
+		dst.copyFrom( *frame.mChannel8u, frame.mChannel8u->getBounds() );
+	}
+	return true;
+}
+
+bool CapturePvApi::copyInto( const Frame &frame, Channel16u &dst ) const
+{
+	if ( ! hasSize( frame, dst ) )
+	{
+		return false;
+	}
+
+	if ( frame.mSurface16u )
+	{
+		ip::grayscale( *frame.mSurface16u, &dst );
+	}
+	else
+	if ( frame.mSurface8u )
+	{
+		convert8uTo16u( *frame.mSurface8u, &dst, std::atomic_load( &mStripes ).get() );
+	}
+	else
+	if ( frame.mChannel16u )
+	{
+		dst.copyFrom( *frame.mChannel16u, frame.mChannel16u->getBounds() );
+	}
+	else
+	{
+		convert8uTo16u( *frame.mChannel8u, &dst, std::atomic_load( &mStripes ).get() );
+	}
+	return true;
+}
+
+bool CapturePvApi::copyInto( const Frame &frame, Surface8u &dst ) const
+{
+	if ( ! hasSize( frame, dst ) )
+	{
+		return false;
+	}
+
+	ParallelStripesRef stripes = std::atomic_load( &mStripes );
+	const LevelMapping mapping = getLevelMapping( frame );
+	if ( frame.mSurface16u )
+	{
+		convert16uTo8u( *frame.mSurface16u, &dst, mapping, stripes.get() );
+	}
+	else
+	if ( frame.mSurface8u )
+	{
+		// converts the channel order if needed
+		dst.copyFrom( *frame.mSurface8u, frame.mSurface8u->getBounds() );
+	}
+	else
+	if ( frame.mChannel16u )
+	{
+		convert16uTo8u( *frame.mChannel16u, &dst, mapping, stripes.get() );
+	}
+	else
+	{
+		convert8uToSurface( *frame.mChannel8u, &dst, stripes.get() );
+	}
+	return true;
+}
+
+bool CapturePvApi::copyInto( const Frame &frame, Surface16u &dst ) const
+{
+	if ( ! frame.mSurface16u || ! hasSize( frame, dst ) )
+	{
+		return false;
+	}
+
+	dst.copyFrom( *frame.mSurface16u, frame.mSurface16u->getBounds() );
+	return true;
+}
+
+LevelMapping CapturePvApi::getLevelMapping( const Frame &frame ) const
+{
+	const uint32_t bitDepth = getSignificantBits( frame );
+
+	uint32_t window = mLevelWindow.load( std::memory_order_relaxed );
+	if ( window == 0 )
+	{
+		window = ( ( 1u << bitDepth ) - 1 ) << 16;
+	}
+
+	const uint16_t minLevel = uint16_t( window & 0xffff );
+	const uint16_t maxLevel = uint16_t( window >> 16 );
+	return LevelMapping( minLevel, maxLevel, mToneMap.getLut( minLevel, maxLevel, bitDepth ) );
+}
+
+Channel8uRef CapturePvApi::getConvertedChannel8u( const Channel16u &channel16u, const LevelMapping &mapping ) const
+{
+	// the cache may be replaced by start()
+	Channel8uRef channel = std::atomic_load( &mChannelCache8u )->getNewChannel();
+
+	convert16uTo8u( channel16u, channel.get(), mapping, std::atomic_load( &mStripes ).get() );
+	return channel;
+}
+
+Surface8uRef CapturePvApi::getConvertedSurface8u( const Frame &frame, const LevelMapping &mapping ) const
+{
+	if ( ! frame )
+	{
+		return Surface8uRef();
+	}
+
+	Surface8uRef surface = std::atomic_load( &mSurfaceCache8u )->getNewSurface();
+	ParallelStripesRef stripes = std::atomic_load( &mStripes );
+	if ( frame.mSurface16u )
+	{
+		convert16uTo8u( *frame.mSurface16u, surface.get(), mapping, stripes.get() );
+	}
+	else
+	if ( frame.mChannel16u )
+	{
+		convert16uTo8u( *frame.mChannel16u, surface.get(), mapping, stripes.get() );
+	}
+	else
+	if ( frame.mChannel8u )
+	{
+		convert8uToSurface( *frame.mChannel8u, surface.get(), stripes.get() );
+	}
+	return surface;
 }
 
 tPvUint32 CapturePvApi::getAttr( const std::string &name ) const
@@ -1,12 +1,17 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <exception>
+#include <map>
 #include <memory>
-#include <vector>
+#include <mutex>
 #include <vector>
 
 #include "cinder/Cinder.h"
 #include "cinder/CurrentFunction.h"
+#include "cinder/Filesystem.h"
 #include "cinder/Thread.h"
 
 #if defined( CINDER_MAC )
@@ -20,7 +25,19 @@
 #include "PvApi.h"
 
 #include "ChannelCache.h"
+#include "ClockSync.h"
+#include "ConversionPool.h"
+#include "Demosaic.h"
+#include "FlatFieldCorrection.h"
+#include "FrameAccumulator.h"
+#include "FrameMailbox.h"
+#include "FrameQueue.h"
+#include "FrameStatistics.h"
+#include "LatencyHistogram.h"
+#include "ParallelStripes.h"
+#include "PixelConversion.h"
 #include "SurfaceCache.h"
+#include "ToneMap.h"
 
 namespace mndl { namespace pvapi {
 
@@ -49,6 +66,110 @@ class CapturePvApi
 	};
 	typedef std::shared_ptr< Device > DeviceRef;
 
+	enum class PixelFormat
+	{
+		MONO8,
+		MONO16,
+		MONO12PACKED,
+		RGB24,
+		BAYER8,
+		BAYER16,
+		BAYER12PACKED,
+		BGR24,
+		RGBA32,
+		BGRA32,
+		RGB48,
+		YUV411,
+		YUV422,
+		YUV444,
+		NOT_SUPPORTED
+	};
+
+	//! A captured frame, the pixels in the representation they were captured in and the frame information from the driver.
+	class Frame
+	{
+	  public:
+		//! Returns whether the frame holds pixels.
+		explicit operator bool() const { return mChannel8u || mChannel16u || mSurface8u || mSurface16u; }
+
+		//! Returns the pixels for Mono8 frames and the mosaic for Bayer8 frames, null otherwise.
+		const ci::Channel8uRef & getChannel8u() const { return mChannel8u; }
+		//! Returns the pixels for Mono16 and Mono12Packed frames and the mosaic for Bayer16 and Bayer12Packed frames, null otherwise.
+		const ci::Channel16uRef & getChannel16u() const { return mChannel16u; }
+		//! Returns the pixels for Rgb24, Bgr24, Rgba32 and Bgra32 frames in their channel order, the colors of Bayer8 and YUV frames, null otherwise.
+		const ci::Surface8uRef & getSurface8u() const { return mSurface8u; }
+		//! Returns the pixels for Rgb48 frames and the interpolated colors for Bayer16 and Bayer12Packed frames, null otherwise.
+		const ci::Surface16uRef & getSurface16u() const { return mSurface16u; }
+
+		PixelFormat getPixelFormat() const { return mPixelFormat; }
+		//! Returns the time stamp of the frame in camera ticks, see the TimestampFrequency attribute.
+		uint64_t getTimestamp() const { return mTimestamp; }
+		//! Returns the 16-bit frame counter of the camera, which rolls over at 65535.
+		uint32_t getFrameCount() const { return mFrameCount; }
+		//! Returns the frame counter extended to 64 bits, counting from the first frame after start().
+		uint64_t getSequenceNumber() const { return mSequenceNumber; }
+		//! Returns the readout region of the frame on the sensor.
+		const ci::Area & getRoi() const { return mRoi; }
+		int32_t getWidth() const { return mRoi.getWidth(); }
+		int32_t getHeight() const { return mRoi.getHeight(); }
+		//! Returns the number of significant bits per pixel.
+		uint32_t getBitDepth() const { return mBitDepth; }
+		tPvBayerPattern getBayerPattern() const { return mBayerPattern; }
+		//! Returns the time stamp of the frame mapped to the host clock.
+		ClockSync::Clock::time_point getHostTimestamp() const { return mHostTimestamp; }
+		//! Returns the host time the frame was picked up from the driver.
+		LatencyHistogram::Clock::time_point getArrivalTime() const { return mArrivalTime; }
+		//! Returns the frame downscaled by the preview scale to RGB if enabled with setPreviewScale(), null otherwise.
+		const ci::Surface8uRef & getPreview() const { return mPreview; }
+		//! Returns the mean levels of the last frames if enabled with setAccumulationLength(), the mosaic for Bayer frames, null otherwise.
+		const ci::Channel16uRef & getMean16u() const { return mMean16u; }
+		//! Returns the unrounded mean levels if enabled with setAccumulationFloat(), null otherwise.
+		const ci::Channel32fRef & getMean32f() const { return mMean32f; }
+		//! Returns the number of frames averaged into the mean levels, 0 without accumulation.
+		size_t getNumAveraged() const { return mNumAveraged; }
+		//! Returns whether the dark frame and flat field correction was applied to the levels.
+		bool isCorrected() const { return mCorrected; }
+		//! Returns the histogram and exposure statistics of the Mono or Bayer levels if enabled with setStatisticsEnabled(), null otherwise.
+		const FrameStatisticsRef & getStatistics() const { return mStatistics; }
+
+	  protected:
+		ci::Channel8uRef mChannel8u;
+		ci::Channel16uRef mChannel16u;
+		ci::Surface8uRef mSurface8u;
+		ci::Surface16uRef mSurface16u;
+
+		PixelFormat mPixelFormat = PixelFormat::NOT_SUPPORTED;
+		uint64_t mTimestamp = 0;
+		uint32_t mFrameCount = 0;
+		uint64_t mSequenceNumber = 0;
+		ci::Area mRoi;
+		uint32_t mBitDepth = 0;
+		tPvBayerPattern mBayerPattern = ePvBayerRGGB;
+		ClockSync::Clock::time_point mHostTimestamp;
+		LatencyHistogram::Clock::time_point mArrivalTime;
+		ci::Surface8uRef mPreview;
+		FrameStatisticsRef mStatistics;
+		bool mCorrected = false;
+		ci::Channel16uRef mMean16u;
+		ci::Channel32fRef mMean32f;
+		size_t mNumAveraged = 0;
+
+		//! Representations derived from the pixels, computed on first use and shared by the copies of the frame.
+		struct Conversions
+		{
+			std::mutex mMutex;
+			ci::Channel8uRef mChannel8u;
+			ci::Channel16uRef mChannel16u;
+			ci::Surface8uRef mSurface8u;
+			//! how the 8-bit representations were mapped from 16 bits
+			LevelMapping mChannel8uMapping;
+			LevelMapping mSurface8uMapping;
+		};
+		std::shared_ptr< Conversions > mConversions;
+
+		friend class CapturePvApi;
+	};
+
 	static void init();
 	static void cleanup();
 
@@ -69,12 +190,230 @@ class CapturePvApi
 	void start();
 	void stop();
 
+	//! Sets the number of frame buffers queued to the driver. Takes effect on the next start().
+	void setNumFrameBuffers( size_t numFrameBuffers ) { mNumFrameBuffers = std::max< size_t >( numFrameBuffers, 1 ); }
+	//! Returns the number of frame buffers queued to the driver.
+	size_t getNumFrameBuffers() const { return mNumFrameBuffers; }
+
+	enum class CaptureMode
+	{
+		//! A capture thread per camera waits for the completed frames.
+		WAIT_THREAD,
+		//! Completed frames are processed in the frame-done callback of the
+		//! driver. Falls back to WAIT_THREAD with DeliveryPolicy::FIFO_BLOCK.
+		FRAME_CALLBACK
+	};
+
+	//! Sets how completed frames are picked up from the driver. Takes effect on the next start().
+	void setCaptureMode( CaptureMode mode ) { mCaptureMode = mode; }
+	//! Returns how completed frames are picked up from the driver.
+	CaptureMode getCaptureMode() const { return mCaptureMode; }
+
+	//! Sets the row alignment, the page size and the locking of the frame
+	//! buffers of all caches. The rows the driver captures into stay tightly
+	//! packed. Takes effect on the next start(), frames still held keep their
+	//! buffers.
+	void setFrameBufferOptions( const FrameBufferOptions &options ) { mFrameBufferOptions = options; }
+	const FrameBufferOptions & getFrameBufferOptions() const { return mFrameBufferOptions; }
+
+	//! Sets the memory all caches may hold together, 2 GB by default. When
+	//! all blocks of a cache are taken it grows by a block within the limit,
+	//! past the limit the block is allocated for the frame only.
+	void setPoolMemoryLimit( size_t bytes ) { mPoolBudget->setMaxBytes( bytes ); }
+	size_t getPoolMemoryLimit() const { return mPoolBudget->getMaxBytes(); }
+	//! Returns the memory of the blocks of the caches, including the blocks frames still hold after their cache was replaced.
+	size_t getPoolMemoryUsage() const { return mPoolBudget->getNumBytes(); }
+	//! Returns the block counters of all caches added up, the misses show
+	//! frames held longer than the caches were sized for. Must not be called
+	//! concurrently with start().
+	PoolStats getPoolStats() const;
+	void resetPoolStats();
+
+	//! Sets the number of threads converting packed formats, 0 converts on the capture thread. Takes effect on the next start().
+	void setNumConversionThreads( size_t numThreads ) { mNumConversionThreads = numThreads; }
+	size_t getNumConversionThreads() const { return mNumConversionThreads; }
+	//! Sets the number of extra threads splitting the rows of each converted frame, for large sensors. Takes effect on the next start().
+	void setNumStripeThreads( size_t numThreads ) { mNumStripeThreads = numThreads; }
+	size_t getNumStripeThreads() const { return mNumStripeThreads; }
+
+	//! Frame counters since start(), lost frames are counted by cause.
+	struct FrameStats
+	{
+		//! frames published to the consumer
+		uint64_t numFramesDelivered = 0;
+		//! frames completed by the driver with an error status
+		uint64_t numFramesFailed = 0;
+		//! frames missing from the sequence of frame counters
+		uint64_t numFramesMissing = 0;
+		//! frames dropped because the conversion threads fell behind
+		uint64_t numFramesSkipped = 0;
+		//! frames replaced by a newer one before the consumer picked them up
+		uint64_t numFramesOverwritten = 0;
+		//! times the capture waited for the consumer with DeliveryPolicy::FIFO_BLOCK
+		uint64_t numFramesBlocked = 0;
+		//! queued frames dropped with DeliveryPolicy::FIFO_DROP_OLDEST
+		uint64_t numFramesDroppedOldest = 0;
+		//! new frames dropped with DeliveryPolicy::FIFO_DROP_NEWEST
+		uint64_t numFramesDroppedNewest = 0;
+	};
+
+	//! Returns the frame counters since start().
+	FrameStats getFrameStats() const;
+	//! Zeroes the frame counters.
+	void resetFrameStats();
+
+	//! Stages of the capture pipeline with a latency histogram.
+	enum class Stage
+	{
+		//! blocking in PvCaptureWaitForFrameDone, capture thread mode only
+		WAIT_FOR_FRAME,
+		//! unpacking or converting the pixels
+		CONVERT,
+		//! getting a block from the caches
+		POOL_ACQUIRE,
+		//! publishing the frame to the consumer
+		PUBLISH,
+		//! from the arrival of a frame until the consumer picks it up
+		CONSUMER_PICKUP,
+		NUM_STAGES
+	};
+
+	//! Returns the latency histogram of \a stage. Only filled if MNDL_PVAPI_LATENCY_HISTOGRAMS is enabled.
+	const LatencyHistogram & getLatencyHistogram( Stage stage ) const { return mLatencyHistograms[ size_t( stage ) ]; }
+	void resetLatencyHistograms();
+
+	//! Returns the number of frames the camera dropped, because no buffer was queued in time.
+	tPvUint32 getNumFramesDropped() const { return getAttr( "StatFramesDropped" ); }
+	//! Returns the number of frames the camera completed successfully.
+	tPvUint32 getNumFramesCompleted() const { return getAttr( "StatFramesCompleted" ); }
+
+	enum class DeliveryPolicy
+	{
+		//! Only the latest frame is kept, frames the consumer did not pick up in time are skipped.
+		LATEST,
+		//! Frames are queued, the capture waits for the consumer when the queue
+		//! is full and the conversion waits for the capture. No frame is
+		//! dropped after it reached the host, the camera drops frames while no
+		//! buffer is queued. The frames are picked up on a capture thread in
+		//! either capture mode, since the driver callback must not wait.
+		FIFO_BLOCK,
+		//! Frames are queued, the oldest queued frame is dropped when the queue is full.
+		FIFO_DROP_OLDEST,
+		//! Frames are queued, new frames are dropped when the queue is full.
+		FIFO_DROP_NEWEST
+	};
+
+	//! Sets how frames are delivered and the length of the queue for the FIFO policies. Takes effect on the next start().
+	void setDeliveryPolicy( DeliveryPolicy policy, size_t queueSize = 16 ) { mDeliveryPolicy = policy; mFrameQueueSize = queueSize; }
+	DeliveryPolicy getDeliveryPolicy() const { return mDeliveryPolicy; }
+
+	//! With a FIFO delivery policy takes the oldest queued frame, waiting up to \a timeout for one. Returns false if no frame was available.
+	bool popFrame( Frame *frame, std::chrono::milliseconds timeout = std::chrono::milliseconds( 0 ) );
+	//! Returns the number of frames in the FIFO.
+	size_t getNumQueuedFrames() const { return mFrameQueue.size(); }
+
+	//! Sets how the colors of Bayer frames are interpolated, BILINEAR by default.
+	void setDemosaicMethod( DemosaicMethod method ) { mDemosaicMethod = method; }
+	DemosaicMethod getDemosaicMethod() const { return mDemosaicMethod; }
+
+	//! Sets the levels of 16-bit frames mapped to 0 and 255 when they are converted to 8 bits.
+	void setLevelWindow( uint16_t minLevel, uint16_t maxLevel ) { mLevelWindow = ( uint32_t( maxLevel ) << 16 ) | minLevel; }
+	//! Maps the full range of the bit depth of each frame to 8 bits, which is the default.
+	void resetLevelWindow() { mLevelWindow = 0; }
+	//! Returns the tone curve applied to the level window, linear by default.
+	ToneMap & getToneMap() { return mToneMap; }
+
+	//! Enables computing the histogram and exposure statistics of Mono and
+	//! Bayer frames on the conversion threads, see Frame::getStatistics().
+	//! Packed frames are measured while they are unpacked.
+	void setStatisticsEnabled( bool enabled ) { mStatisticsEnabled = enabled; }
+	bool isStatisticsEnabled() const { return mStatisticsEnabled; }
+
+	//! Sets the factor of 2 or 4 the preview of each frame is downscaled by,
+	//! 1 disables the preview. The preview is computed once per frame on the
+	//! conversion threads. Takes effect on the next start().
+	void setPreviewScale( size_t scale ) { mPreviewScale = scale >= 4 ? 4 : ( scale >= 2 ? 2 : 1 ); }
+	size_t getPreviewScale() const { return mPreviewScale; }
+
+	//! Averages the levels of Mono and Bayer frames over the last \a numFrames
+	//! frames, see Frame::getMean16u(). The sums are updated on the conversion
+	//! threads by adding each frame and subtracting the oldest, the last
+	//! frames are kept with 16 bits per level. They take \a numFrames x 2
+	//! bytes per pixel, 10 MB per frame of 5 MP, so the length is capped to
+	//! FrameAccumulator::getMaxFrames() of the sensor, at most
+	//! FrameAccumulator::kMaxFrames and 1 GB, 107 frames of 5 MP. 1 disables
+	//! the accumulation. Takes effect on the next start().
+	void setAccumulationLength( size_t numFrames ) { mAccumulationLength = std::max< size_t >( numFrames, 1 ); }
+	size_t getAccumulationLength() const { return mAccumulationLength; }
+	//! Enables the float mean of the accumulation besides the rounded one. Takes effect on the next start().
+	void setAccumulationFloat( bool enabled ) { mAccumulationFloat = enabled; }
+	bool isAccumulationFloat() const { return mAccumulationFloat; }
+	//! Starts a new average with the next frame, for example after the scene or the exposure changed.
+	void resetAccumulation() { mAccumulationReset = true; }
+
+	//! the most frames a calibration averages, the per-pixel sums of 16-bit levels fit 32 bits
+	static const size_t kMaxCalibrationFrames = 65536;
+
+	//! Averages the next \a numFrames frames, up to kMaxCalibrationFrames,
+	//! into the dark frame of the correction, with the lens covered.
+	void calibrateDark( size_t numFrames );
+	//! Averages the next \a numFrames frames, up to kMaxCalibrationFrames, of
+	//! a uniformly lit target into the flat field of the correction, the dark
+	//! frame is subtracted. Bayer frames keep their color balance.
+	void calibrateFlat( size_t numFrames );
+	//! Returns whether a calibration is collecting frames.
+	bool isCalibrating() const { return mCalibrating; }
+
+	//! Enables correcting the levels of Mono and Bayer frames of the size and
+	//! bit depth of the correction on the conversion threads, enabled by
+	//! default. The levels are corrected before they are measured,
+	//! interpolated or converted.
+	void setCorrectionEnabled( bool enabled ) { mCorrectionEnabled = enabled; }
+	bool isCorrectionEnabled() const { return mCorrectionEnabled; }
+	//! Returns the dark frame and flat field correction, null if not calibrated.
+	FlatFieldCorrectionRef getCorrection() const { return std::atomic_load( &mCorrection ); }
+	void setCorrection( const FlatFieldCorrectionRef &correction );
+	//! Writes the correction to \a path, returns false if there is none or it could not be written.
+	bool saveCorrection( const ci::fs::path &path ) const;
+	//! Reads a correction written by saveCorrection(), returns false on failure.
+	bool loadCorrection( const ci::fs::path &path );
+
+	//! Returns whether a frame was captured since the latest frame was picked up.
 	bool checkNewFrame() const;
+	//! Returns the latest frame with its frame information.
+	Frame getFrame() const;
 	ci::Channel8uRef getChannel() const;
 	ci::Channel8uRef getChannel8u() const;
 	ci::Channel16uRef getChannel16u() const;
 	ci::Surface8uRef getSurface() const;
 	ci::Surface8uRef getSurface8u() const;
+	//! Returns the latest frame with 16 bits per color channel for Rgb48, Bayer16 and Bayer12Packed frames, null otherwise.
+	ci::Surface16uRef getSurface16u() const;
+	//! Returns the preview of the latest frame, null if disabled, see setPreviewScale().
+	ci::Surface8uRef getPreview() const;
+	//! Returns the mean levels of the last frames, null if disabled, see setAccumulationLength().
+	ci::Channel16uRef getMean16u() const;
+	ci::Channel32fRef getMean32f() const;
+
+	//! Returns \a frame as an 8-bit channel. Conversions are done once per frame and shared by all callers, the result must not be modified.
+	ci::Channel8uRef getChannel8u( const Frame &frame ) const;
+	//! Returns \a frame as a 16-bit channel, converted once per frame like getChannel8u().
+	ci::Channel16uRef getChannel16u( const Frame &frame ) const;
+	//! Returns \a frame as an 8-bit surface, converted once per frame like getChannel8u().
+	ci::Surface8uRef getSurface8u( const Frame &frame ) const;
+
+	//! Converts the latest frame into \a dst of the size of the frame, any row stride. Returns false if there is no frame or the size differs.
+	bool copyLatestInto( ci::Channel8u &dst ) const { return copyInto( fetchFrame(), dst ); }
+	bool copyLatestInto( ci::Channel16u &dst ) const { return copyInto( fetchFrame(), dst ); }
+	bool copyLatestInto( ci::Surface8u &dst ) const { return copyInto( fetchFrame(), dst ); }
+	//! Copies the latest frame into \a dst for Rgb48, Bayer16 and Bayer12Packed frames, returns false for other formats.
+	bool copyLatestInto( ci::Surface16u &dst ) const { return copyInto( fetchFrame(), dst ); }
+
+	//! Converts \a frame into \a dst like copyLatestInto().
+	bool copyInto( const Frame &frame, ci::Channel8u &dst ) const;
+	bool copyInto( const Frame &frame, ci::Channel16u &dst ) const;
+	bool copyInto( const Frame &frame, ci::Surface8u &dst ) const;
+	bool copyInto( const Frame &frame, ci::Surface16u &dst ) const;
 
 	//! Returns the maximum size of the captured image in pixels.
 	int32_t getSensorWidth() const { return mSensorWidth; }
@@ -94,15 +433,6 @@ class CapturePvApi
 	//! Returns the bounding rectangle of the captured image, which is Area( 0, 0, width, height )
 	ci::Area getBounds() const { return mRoi; }
 
-	enum class PixelFormat
-	{
-		MONO8,
-		MONO16,
-		MONO12PACKED,
-		RGB24,
-		NOT_SUPPORTED
-	};
-
 	tPvHandle getPvHandle() const { return mHandle; }
 
  protected:
@@ -126,19 +456,169 @@ class CapturePvApi
 
 	ci::Area mRoi;
 
+	FrameBufferOptions mFrameBufferOptions;
+	PoolBudgetRef mPoolBudget = PoolBudget::create( size_t( 2048 ) << 20 );
+	//! Calls \a fn with each cache.
+	template< typename F >
+	void forEachCache( F fn ) const;
+	//! Returns the frame buffer options of a cache, with tightly packed rows if the driver captures into it.
+	FrameBufferOptions getCacheOptions( bool captured ) const
+	{
+		FrameBufferOptions options = mFrameBufferOptions;
+		options.mRowAlignment = captured ? 1 : options.mRowAlignment;
+		return options;
+	}
+
+	//! raw frames of the formats which need conversion, a single row of TotalBytesPerFrame bytes
+	ChannelCache8uRef mRawCache;
 	ChannelCache8uRef mChannelCache8u;
 	ChannelCache16uRef mChannelCache16u;
+	//! RGB surfaces of the converted formats
 	SurfaceCache8uRef mSurfaceCache8u;
-	ci::Channel8uRef mCurrentChannel8u;
-	ci::Channel16uRef mCurrentChannel16u;
-	ci::Surface8uRef mCurrentSurface8u;
+	SurfaceCache16uRef mSurfaceCache16u;
+	//! surface caches of the captured channel orders, kept for the surfaces the consumer might hold
+	std::map< int, SurfaceCache8uRef > mSurfaceCaches8u;
+	//! the surfaces Rgb24, Bgr24, Rgba32 and Bgra32 frames are captured into
+	SurfaceCache8uRef mCaptureSurfaceCache8u;
+	//! preview caches of the preview scales, kept for the previews the consumer might hold
+	std::map< size_t, SurfaceCache8uRef > mPreviewCaches;
+	//! cache of the previews of the running capture, null if disabled
+	SurfaceCache8uRef mPreviewCache;
+	//! scale of mPreviewCache, mPreviewScale may change while capturing
+	size_t mPreviewFactor = 1;
+	size_t mPreviewScale = 1;
+	//! caches of the mean levels, kept for the channels the consumer might hold
+	ChannelCache16uRef mMeanCache16u;
+	ChannelCache32fRef mMeanCache32f;
+	mutable FrameMailboxT< Frame > mCurrentFrame;
+	FrameQueueT< Frame > mFrameQueue;
+	DeliveryPolicy mDeliveryPolicy = DeliveryPolicy::LATEST;
+	//! policy of the running capture, latched by start()
+	DeliveryPolicy mActiveDeliveryPolicy = DeliveryPolicy::LATEST;
+	size_t mFrameQueueSize = 16;
+
+	void updateSequence( const tPvFrame &pvFrame );
+	static uint64_t getTimestamp( const tPvFrame &pvFrame );
+	ClockSync mClockSync;
+	bool mHasSequence = false;
+	uint32_t mLastFrameCount = 0;
+	uint64_t mSequenceNumber = 0;
+
+	std::atomic< uint64_t > mNumFramesDelivered { 0 };
+	std::atomic< uint64_t > mNumFramesFailed { 0 };
+	std::atomic< uint64_t > mNumFramesMissing { 0 };
+	std::atomic< uint64_t > mNumFramesSkipped { 0 };
+	std::atomic< uint64_t > mNumFramesOverwritten { 0 };
+
+	mutable std::array< LatencyHistogram, size_t( Stage::NUM_STAGES ) > mLatencyHistograms;
+	LatencyHistogram & histogram( Stage stage ) { return mLatencyHistograms[ size_t( stage ) ]; }
+
+	//! A frame queued to the driver together with the memory it captures into.
+	struct FrameBuffer
+	{
+		tPvFrame mFrame;
+		//! Owner of mFrame.ImageBuffer, a pooled Channel or Surface for formats delivered without conversion.
+		std::shared_ptr< void > mData;
+		LatencyHistogram::Clock::time_point mArrivalTime;
+	};
 
+	void startCapture();
+	void endCapture();
 	void threadedFunc();
+	static void PVDECL frameDoneCallback( tPvFrame *frame );
+	void frameDone( FrameBuffer &frameBuffer );
+	void queueFrame( FrameBuffer &frameBuffer );
+	void stampFrame( const FrameBuffer &frameBuffer, Frame &frame );
+	void processFrame( FrameBuffer &frameBuffer, Frame &frame );
+	//! Moves the captured block of \a frameBuffer to the pixels of \a frame for the formats captured without conversion, returns false for the raw formats.
+	bool takeCapturedPixels( FrameBuffer &frameBuffer, Frame &frame ) const;
+	//! Returns whether frames captured without conversion go through the conversion threads too, for statistics, previews, the correction or the accumulation.
+	bool needsConversion() const { return mStatisticsEnabled || mPreviewCache || mCalibrating || ( mCorrectionEnabled && getCorrection() ) || mAccumulator; }
+	//! Hands the captured block of \a frameBuffer to the conversion of \a frame.
+	void submitConversion( FrameBuffer &frameBuffer, Frame &frame );
+	void publishFrame( Frame &frame );
+
+	//! A captured frame waiting for conversion.
+	struct ConversionJob
+	{
+		Frame mFrame;
+		ci::Channel8uRef mRaw;
+	};
+
+	void convertFrame( ConversionJob &job );
+	//! Returns new statistics for \a frame if they are enabled, null otherwise.
+	std::shared_ptr< FrameStatistics > createStatistics( const Frame &frame ) const;
+	//! Returns the correction if it is enabled and fits \a frame, null otherwise.
+	FlatFieldCorrectionRef getCorrection( const Frame &frame ) const;
+	//! Adds \a channel to the calibration, corrects it in place and adds it to \a stats if not null.
+	template< typename T >
+	void correctLevels( ci::ChannelT< T > &channel, Frame &frame, FrameStatistics *stats );
+	template< typename T >
+	void addCalibrationFrame( const ci::ChannelT< T > &channel, const Frame &frame );
+	//! Adds the levels of \a frame to the accumulation and sets its mean
+	//! levels. Called right before publishing, in capture order.
+	void accumulateFrame( Frame &frame );
+
+	ConversionPoolT< ConversionJob > mConversionPool;
+	size_t mNumConversionThreads = 2;
+	ParallelStripesRef mStripes;
+	size_t mNumStripeThreads = 0;
+	std::atomic< DemosaicMethod > mDemosaicMethod { DemosaicMethod::BILINEAR };
+	//! max << 16 | min, 0 for the range of the bit depth of the frame
+	std::atomic< uint32_t > mLevelWindow { 0 };
+	std::atomic< bool > mStatisticsEnabled { false };
+
+	FlatFieldCorrectionRef mCorrection;
+	std::atomic< bool > mCorrectionEnabled { true };
+
+	//! Frames summed for a calibration.
+	struct Calibration
+	{
+		bool mFlat = false;
+		size_t mNumFrames = 0;
+		size_t mNumAdded = 0;
+		int32_t mWidth = 0;
+		int32_t mHeight = 0;
+		uint32_t mBitDepth = 0;
+		std::vector< uint32_t > mSums;
+	};
+	std::unique_ptr< Calibration > mCalibration;
+	std::mutex mCalibrationMutex;
+	std::atomic< bool > mCalibrating { false };
+
+	//! sums of the last frames of the running capture, null if disabled. Only
+	//! touched by the publish step, one frame at a time in capture order.
+	FrameAccumulatorRef mAccumulator;
+	std::atomic< bool > mAccumulationReset { false };
+	size_t mAccumulationLength = 1;
+	bool mAccumulationFloat = false;
+
+	mutable ToneMap mToneMap;
+
+	//! Returns how the levels of \a frame are mapped to 8 bits.
+	LevelMapping getLevelMapping( const Frame &frame ) const;
+	ci::Channel8uRef getConvertedChannel8u( const ci::Channel16u &channel16u, const LevelMapping &mapping ) const;
+	ci::Surface8uRef getConvertedSurface8u( const Frame &frame, const LevelMapping &mapping ) const;
+	//! Returns whether \a frame has pixels and the size of \a dst.
+	template< typename T >
+	static bool hasSize( const Frame &frame, const T &dst );
+	//! Returns the memoized 16-bit channel of \a frame, its conversions must be locked.
+	const ci::Channel16uRef & getDerivedChannel16u( const Frame &frame ) const;
+	Frame fetchFrame() const;
+
+	std::vector< FrameBuffer > mFrameBuffers;
+	//! Serializes requeueing frames with stopping the capture.
+	std::mutex mQueueMutex;
 
 	std::shared_ptr< std::thread > mThread;
 	mutable std::mutex mMutex;
-	mutable bool mHasNewFrame = false;
-	bool mThreadShouldQuit = false;
+	bool mCapturing = false;
+	std::atomic< bool > mCaptureShouldQuit { false };
+
+	size_t mNumFrameBuffers = 4;
+	CaptureMode mCaptureMode = CaptureMode::WAIT_THREAD;
+	//! mode of the running capture, latched by start()
+	CaptureMode mActiveCaptureMode = CaptureMode::WAIT_THREAD;
 
 	PixelFormat mPixelFormat;
 
@@ -1,53 +1,78 @@
 #pragma once
 
 #include <memory>
-#include <vector>
 
 #include "cinder/Channel.h"
 
+#include "BlockPool.h"
+
+//! Blocks of pixel data wrapped into channels, which return their block to
+//! the pool when their last reference is released. Taking and returning
+//! blocks is lock-free, from any number of threads. Channels may outlive the
+//! cache, see BlockPool. The rows are padded to the row alignment of the
+//! options, the channels the driver captures into need tightly packed rows.
 template< typename T >
 class ChannelCacheT
 {
   public:
-	ChannelCacheT( int32_t width, int32_t height, size_t numChannels ) :
-		mWidth( width ), mHeight( height )
+	ChannelCacheT( int32_t width, int32_t height, size_t numChannels,
+			const mndl::pvapi::FrameBufferOptions &options = mndl::pvapi::FrameBufferOptions() ) :
+		mWidth( width ), mHeight( height ),
+		mRowBytes( mndl::pvapi::getPaddedRowBytes( width * sizeof( T ), options.mRowAlignment ) ),
+		mPool( mndl::pvapi::BlockPool::create( mRowBytes * height, options ) )
 	{
-		for ( size_t i = 0; i < numChannels; ++i )
-		{
-			mChannelData.push_back( std::shared_ptr< T >( new T[ width * height ],
-						std::default_delete< T[] >() ) );
-			mChannelUsed.push_back( false );
-		}
+		reserve( numChannels );
 	}
 
+	//! Grows the cache to hold at least \a numChannels blocks of pixel data, up to BlockPool::kMaxBlocks.
+	void reserve( size_t numChannels ) { mPool->reserve( numChannels ); }
+
+	size_t size() const { return mPool->size(); }
+	int32_t getWidth() const { return mWidth; }
+	int32_t getHeight() const { return mHeight; }
+	size_t getRowBytes() const { return mRowBytes; }
+	const mndl::pvapi::FrameBufferOptions & getOptions() const { return mPool->getOptions(); }
+
+	//! Sets the budget the cache grows within when all of its blocks are taken, see BlockPool.
+	void setBudget( const mndl::pvapi::PoolBudgetRef &budget ) { mPool->setBudget( budget ); }
+	mndl::pvapi::PoolStats getStats() const { return mPool->getStats(); }
+	void resetStats() { mPool->resetStats(); }
+
+	//! Changes the size of the channels. The blocks of the old size are
+	//! dropped, channels still holding one stay valid. Must not be called
+	//! while other threads take channels.
 	void resize( int32_t width, int32_t height )
 	{
+		if ( width == mWidth && height == mHeight )
+		{
+			return;
+		}
+
+		const size_t numChannels = mPool->size();
+		const mndl::pvapi::FrameBufferOptions options = mPool->getOptions();
 		mWidth = width;
 		mHeight = height;
+		mRowBytes = mndl::pvapi::getPaddedRowBytes( width * sizeof( T ), options.mRowAlignment );
+		mndl::pvapi::BlockPoolRef pool = mndl::pvapi::BlockPool::create( mRowBytes * height, options );
+		pool->setBudget( mPool->getBudget() );
+		pool->reserve( numChannels );
+		mPool = pool;
 	}
 
 	std::shared_ptr< ci::ChannelT< T > > getNewChannel()
 	{
-		for ( size_t i = 0; i < mChannelData.size(); ++i )
-		{
-			if ( ! mChannelUsed[ i ] )
-			{
-				mChannelUsed[ i ] = true;
-				auto newChannel = new ci::ChannelT< T >( mWidth, mHeight, mWidth * sizeof( T ), 1, mChannelData[ i ].get() );
-				auto result = std::shared_ptr< ci::ChannelT< T > >
-					( newChannel, [ = ] ( ci::ChannelT< T > *c  )
-								  { mChannelUsed[ i ] = false; } );
-				return result;
-			}
-		}
-
-		return ci::ChannelT< T >::create( mWidth, mHeight );
+		mndl::pvapi::BlockPool::Block block = mPool->acquire();
+		auto newChannel = new ci::ChannelT< T >( mWidth, mHeight, mRowBytes, 1, reinterpret_cast< T * >( block.mData.get() ) );
+		std::weak_ptr< mndl::pvapi::BlockPool > pool = mPool;
+		return std::shared_ptr< ci::ChannelT< T > >
+			( newChannel, [ pool, block ] ( ci::ChannelT< T > *c )
+						  { mndl::pvapi::BlockPool::release( pool, block.mIndex ); delete c; } );
 	}
 
   private:
-	std::vector< std::shared_ptr< T > > mChannelData;
-	std::vector< bool > mChannelUsed;
 	int32_t mWidth, mHeight;
+	size_t mRowBytes;
+	mndl::pvapi::BlockPoolRef mPool;
 };
 
 typedef ChannelCacheT< uint8_t > ChannelCache;
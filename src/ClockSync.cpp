@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <limits>
+
+#include "ClockSync.h"
+
+namespace mndl { namespace pvapi {
+
+constexpr double ClockSync::kBucketSeconds;
+
+ClockSync::ClockSync( size_t windowSize ) :
+	mWindowSize( std::max< size_t >( windowSize, 2 ) )
+{
+	reset( 1 );
+}
+
+void ClockSync::reset( uint64_t tickFrequency )
+{
+	mTickFrequency = std::max< uint64_t >( tickFrequency, 1 );
+	mHasSample = false;
+	mWindow.clear();
+	mWindow.reserve( mWindowSize );
+	mNext = 0;
+	mOffset = 0.0;
+	mSlope = 0.0;
+	mWindowOffset = std::numeric_limits< double >::infinity();
+}
+
+void ClockSync::addSample( uint64_t ticks, Clock::time_point arrival )
+{
+	// the camera clock was reset
+	if ( mHasSample && ticks < mLastTicks )
+	{
+		reset( mTickFrequency );
+	}
+
+	if ( ! mHasSample )
+	{
+		mRefTicks = ticks;
+		mRefHost = arrival;
+	}
+	mLastTicks = ticks;
+
+	Sample sample;
+	sample.mX = double( ticks - mRefTicks ) / double( mTickFrequency );
+	sample.mY = std::chrono::duration< double >( arrival - mRefHost ).count() - sample.mX;
+
+	int64_t bucket = int64_t( sample.mX / kBucketSeconds );
+	if ( ! mHasSample )
+	{
+		mHasSample = true;
+		mBucket = bucket;
+		mBucketMin = sample;
+		updateOffset();
+	}
+	else
+	if ( bucket != mBucket )
+	{
+		// close the bucket
+		if ( mWindow.size() < mWindowSize )
+		{
+			mWindow.push_back( mBucketMin );
+		}
+		else
+		{
+			mWindow[ mNext ] = mBucketMin;
+		}
+		mNext = ( mNext + 1 ) % mWindowSize;
+
+		mBucket = bucket;
+		mBucketMin = sample;
+		fit();
+		updateOffset();
+	}
+	else
+	if ( sample.mY < mBucketMin.mY )
+	{
+		mBucketMin = sample;
+		updateOffset();
+	}
+}
+
+void ClockSync::fit()
+{
+	// least squares slope over the closed buckets, centered to keep the
+	// precision as the time since the reference grows
+	const size_t n = mWindow.size();
+	if ( n >= 2 )
+	{
+		double meanX = 0.0, meanY = 0.0;
+		for ( const auto &s : mWindow )
+		{
+			meanX += s.mX;
+			meanY += s.mY;
+		}
+		meanX /= n;
+		meanY /= n;
+
+		double sxx = 0.0, sxy = 0.0;
+		for ( const auto &s : mWindow )
+		{
+			sxx += ( s.mX - meanX ) * ( s.mX - meanX );
+			sxy += ( s.mX - meanX ) * ( s.mY - meanY );
+		}
+		mSlope = sxx > 0.0 ? sxy / sxx : 0.0;
+	}
+
+	// move the line down to the lowest bucket
+	mWindowOffset = std::numeric_limits< double >::infinity();
+	for ( const auto &s : mWindow )
+	{
+		mWindowOffset = std::min( mWindowOffset, s.mY - mSlope * s.mX );
+	}
+}
+
+void ClockSync::updateOffset()
+{
+	mOffset = std::min( mWindowOffset, mBucketMin.mY - mSlope * mBucketMin.mX );
+}
+
+ClockSync::Clock::time_point ClockSync::toHostTime( uint64_t ticks ) const
+{
+	if ( ! mHasSample )
+	{
+		return Clock::time_point();
+	}
+
+	double x = ( ticks >= mRefTicks ) ? double( ticks - mRefTicks ) : -double( mRefTicks - ticks );
+	x /= double( mTickFrequency );
+	double host = x + mOffset + mSlope * x;
+	return mRefHost + std::chrono::duration_cast< Clock::duration >( std::chrono::duration< double >( host ) );
+}
+
+} } // mndl::pvapi
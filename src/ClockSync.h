@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace mndl { namespace pvapi {
+
+//! Maps the tick counter of a camera to the host clock. The offset and drift
+//! are estimated online from the camera time stamps and the host arrival
+//! times of the frames. Arrival times only ever lag behind due to transfer and
+//! scheduling, so the drift is fitted with a least squares line over a
+//! sliding window and the offset follows the lower envelope of the samples
+//! rather than their mean, which keeps the mapping stable under network
+//! jitter. Samples are reduced to their minimum over buckets of half a
+//! second, the window spans \a windowSize buckets. The line is refitted when
+//! a bucket closes, in between only a new minimum of the open bucket can
+//! lower the offset. The mapped time includes the minimum latency between
+//! the time stamp and the arrival, which cannot be told apart from the clock
+//! offset.
+class ClockSync
+{
+  public:
+	typedef std::chrono::steady_clock Clock;
+
+	explicit ClockSync( size_t windowSize = 240 );
+
+	//! Starts over with a camera clock of \a tickFrequency Hz.
+	void reset( uint64_t tickFrequency );
+
+	//! Adds a frame time stamped with \a ticks that arrived at \a arrival.
+	void addSample( uint64_t ticks, Clock::time_point arrival );
+
+	//! Returns whether a sample was added for a mapping.
+	bool isValid() const { return mHasSample; }
+
+	//! Returns the host time of the camera time stamp \a ticks.
+	Clock::time_point toHostTime( uint64_t ticks ) const;
+
+	//! Returns the drift of the camera clock relative to the host clock in parts per million, positive if the camera clock runs fast.
+	double getDriftPpm() const { return -mSlope * 1e6; }
+
+  private:
+	struct Sample
+	{
+		double mX; // camera seconds since the reference
+		double mY; // host seconds minus camera seconds since the reference
+	};
+
+	static constexpr double kBucketSeconds = 0.5;
+
+	//! Fits the line to the closed buckets.
+	void fit();
+	//! Lowers the line of the closed buckets to the minimum of the open bucket if it is below.
+	void updateOffset();
+
+	uint64_t mTickFrequency = 0;
+	uint64_t mLastTicks = 0;
+	uint64_t mRefTicks = 0;
+	Clock::time_point mRefHost;
+	bool mHasSample = false;
+
+	//! minimum of the samples in the current bucket
+	Sample mBucketMin;
+	int64_t mBucket = 0;
+
+	//! ring of bucket minimums
+	std::vector< Sample > mWindow;
+	size_t mWindowSize;
+	size_t mNext = 0;
+
+	//! host - camera = mOffset + mSlope * camera, in seconds since the reference
+	double mOffset = 0.0;
+	double mSlope = 0.0;
+	//! offset of the line through the lowest closed bucket
+	double mWindowOffset = 0.0;
+};
+
+} } // mndl::pvapi
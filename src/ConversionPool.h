@@ -0,0 +1,163 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mndl { namespace pvapi {
+
+//! Worker threads converting frames off the capture thread. Jobs are
+//! converted in parallel and handed to the publish function one at a time in
+//! the order they were submitted. The jobs are kept in a ring allocated by
+//! start(), submit() rejects a job when the ring is full unless asked to wait
+//! for a slot.
+template< typename Job >
+class ConversionPoolT
+{
+  public:
+	typedef std::function< void( Job & ) > JobFn;
+
+	ConversionPoolT( const JobFn &convertFn, const JobFn &publishFn ) :
+		mConvertFn( convertFn ), mPublishFn( publishFn )
+	{
+	}
+
+	~ConversionPoolT()
+	{
+		stop();
+	}
+
+	//! Starts \a numThreads workers with room for \a capacity jobs in flight.
+	void start( size_t numThreads, size_t capacity )
+	{
+		stop();
+
+		mSlots.clear();
+		mSlots.resize( std::max< size_t >( capacity, 1 ) );
+		mNextTicket = mRunTicket = mPublishTicket = 0;
+		mPublishing = false;
+		mShouldQuit = false;
+		for ( size_t i = 0; i < numThreads; i++ )
+		{
+			mThreads.emplace_back( std::make_shared< std::thread >( std::bind( &ConversionPoolT::threadedFunc, this ) ) );
+		}
+	}
+
+	//! Stops the workers, jobs which are not converted yet are dropped.
+	void stop()
+	{
+		{
+			std::lock_guard< std::mutex > lock( mMutex );
+			mShouldQuit = true;
+		}
+		mCondition.notify_all();
+		mSlotFree.notify_all();
+
+		for ( auto &thread : mThreads )
+		{
+			thread->join();
+		}
+		mThreads.clear();
+
+		for ( auto &slot : mSlots )
+		{
+			slot.mJob = Job();
+			slot.mDone = false;
+		}
+	}
+
+	bool isRunning() const { return ! mThreads.empty(); }
+
+	//! Queues \a job for conversion. If too many jobs are in flight waits for
+	//! one to be published when \a wait is set, returns false otherwise. Also
+	//! returns false if the pool is stopped while waiting.
+	bool submit( Job &&job, bool wait = false )
+	{
+		{
+			std::unique_lock< std::mutex > lock( mMutex );
+			if ( wait )
+			{
+				mSlotFree.wait( lock, [ this ] { return mShouldQuit || mNextTicket - mPublishTicket < mSlots.size(); } );
+			}
+			if ( mShouldQuit || mNextTicket - mPublishTicket >= mSlots.size() )
+			{
+				return false;
+			}
+			mSlots[ mNextTicket % mSlots.size() ].mJob = std::move( job );
+			mNextTicket++;
+		}
+		mCondition.notify_one();
+		return true;
+	}
+
+  private:
+	struct Slot
+	{
+		Job mJob;
+		bool mDone = false;
+	};
+
+	void threadedFunc()
+	{
+		std::unique_lock< std::mutex > lock( mMutex );
+		while ( true )
+		{
+			mCondition.wait( lock, [ this ] { return mShouldQuit || mRunTicket < mNextTicket; } );
+			if ( mShouldQuit )
+			{
+				return;
+			}
+
+			Slot &slot = mSlots[ mRunTicket % mSlots.size() ];
+			mRunTicket++;
+			lock.unlock();
+			mConvertFn( slot.mJob );
+			lock.lock();
+			slot.mDone = true;
+
+			// the worker already publishing picks up this job when its turn comes
+			if ( mPublishing )
+			{
+				continue;
+			}
+
+			mPublishing = true;
+			while ( ! mShouldQuit && mPublishTicket < mRunTicket && mSlots[ mPublishTicket % mSlots.size() ].mDone )
+			{
+				Slot &next = mSlots[ mPublishTicket % mSlots.size() ];
+				lock.unlock();
+				mPublishFn( next.mJob );
+				next.mJob = Job();
+				lock.lock();
+				next.mDone = false;
+				mPublishTicket++;
+				mSlotFree.notify_one();
+			}
+			mPublishing = false;
+		}
+	}
+
+	JobFn mConvertFn;
+	JobFn mPublishFn;
+
+	std::vector< Slot > mSlots;
+	//! ticket of the next job submitted, converted and published
+	uint64_t mNextTicket = 0;
+	uint64_t mRunTicket = 0;
+	uint64_t mPublishTicket = 0;
+	bool mPublishing = false;
+	bool mShouldQuit = false;
+
+	std::mutex mMutex;
+	std::condition_variable mCondition;
+	//! signaled when a job is published and its slot can take a new one
+	std::condition_variable mSlotFree;
+	std::vector< std::shared_ptr< std::thread > > mThreads;
+};
+
+} } // mndl::pvapi
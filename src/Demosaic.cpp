@@ -0,0 +1,305 @@
+#include <algorithm>
+#include <limits>
+
+#include "Demosaic.h"
+#include "PixelConversion.h"
+#include "Simd.h"
+
+namespace mndl { namespace pvapi {
+
+// Every row of the mosaic alternates green with one of red or blue, called A
+// below, the rows above and below alternate green with the other one, called
+// O. At the A sites of a row green is the average of the four neighbors and O
+// the average of the four diagonals, at the green sites A is the average of
+// the left and right and O of the upper and lower neighbor. Averages of four
+// are the rounded average of two rounded averages, which is what the vector
+// versions compute, so all versions give the same result. The mosaic is
+// mirrored at the borders.
+
+//! The colors of a row of the mosaic.
+struct RowLayout
+{
+	//! whether A is at the even columns
+	bool aEven;
+	//! whether A is red
+	bool aRed;
+};
+
+static RowLayout getRowLayout( BayerPattern pattern, size_t y )
+{
+	// colors of the top left 2x2 pixels, 0 red, 1 green, 2 blue
+	static const uint8_t kColors[ 4 ][ 4 ] = {
+		{ 0, 1, 1, 2 },
+		{ 1, 2, 0, 1 },
+		{ 1, 0, 2, 1 },
+		{ 2, 1, 1, 0 }
+	};
+	const uint8_t *colors = kColors[ size_t( pattern ) & 3 ] + ( y & 1 ) * 2;
+	RowLayout layout;
+	layout.aEven = colors[ 0 ] != 1;
+	layout.aRed = colors[ 0 ] == 0 || colors[ 1 ] == 0;
+	return layout;
+}
+
+template< typename T >
+static inline T average( T a, T b )
+{
+	return T( ( uint32_t( a ) + b + 1 ) >> 1 );
+}
+
+template< typename T >
+static inline T absDiff( T a, T b )
+{
+	return a > b ? a - b : b - a;
+}
+
+//! Where the interpolated colors of a row are written.
+struct PixelLayout
+{
+	uint8_t pixelInc;
+	uint8_t redOffset;
+	uint8_t greenOffset;
+	uint8_t blueOffset;
+};
+
+template< typename T >
+static void interpolateRowScalar( const T *up, const T *row, const T *down, T *dst, size_t begin, size_t end, size_t width,
+		RowLayout layout, PixelLayout pixel, DemosaicMethod method, bool oddRow )
+{
+	const uint8_t aOffset = layout.aRed ? pixel.redOffset : pixel.blueOffset;
+	const uint8_t oOffset = layout.aRed ? pixel.blueOffset : pixel.redOffset;
+	// the other row of the 2x2 block for NEAREST
+	const T *other = oddRow ? up : down;
+
+	for ( size_t x = begin; x < end; x++ )
+	{
+		const size_t left = x > 0 ? x - 1 : std::min< size_t >( 1, width - 1 );
+		const size_t right = x + 1 < width ? x + 1 : left;
+		const bool aSite = ( ( x & 1 ) == 0 ) == layout.aEven;
+		T a, g, o;
+
+		if ( method == DemosaicMethod::NEAREST )
+		{
+			const size_t partner = ( x ^ 1 ) < width ? x ^ 1 : left;
+			a = aSite ? row[ x ] : row[ partner ];
+			g = aSite ? row[ partner ] : row[ x ];
+			o = aSite ? other[ partner ] : other[ x ];
+		}
+		else
+		{
+			const T h = average( row[ left ], row[ right ] );
+			const T v = average( up[ x ], down[ x ] );
+			if ( aSite )
+			{
+				a = row[ x ];
+				g = average( h, v );
+				o = average( average( up[ left ], up[ right ] ), average( down[ left ], down[ right ] ) );
+				if ( method == DemosaicMethod::EDGE_AWARE )
+				{
+					const T dh = absDiff( row[ left ], row[ right ] );
+					const T dv = absDiff( up[ x ], down[ x ] );
+					if ( dh < dv )
+					{
+						g = h;
+					}
+					else
+					if ( dv < dh )
+					{
+						g = v;
+					}
+				}
+			}
+			else
+			{
+				a = h;
+				g = row[ x ];
+				o = v;
+			}
+		}
+
+		T *p = dst + x * pixel.pixelInc;
+		p[ aOffset ] = a;
+		p[ pixel.greenOffset ] = g;
+		p[ oOffset ] = o;
+	}
+}
+
+#if MNDL_PVAPI_X86_SIMD
+
+template< typename T >
+struct Lanes;
+
+template<>
+struct Lanes< uint8_t >
+{
+	MNDL_PVAPI_TARGET( "ssse3" ) static __m128i average( __m128i a, __m128i b ) { return _mm_avg_epu8( a, b ); }
+	MNDL_PVAPI_TARGET( "ssse3" ) static __m128i subs( __m128i a, __m128i b ) { return _mm_subs_epu8( a, b ); }
+	MNDL_PVAPI_TARGET( "ssse3" ) static __m128i isZero( __m128i a ) { return _mm_cmpeq_epi8( a, _mm_setzero_si128() ); }
+	MNDL_PVAPI_TARGET( "ssse3" ) static __m128i oddLanes() { return _mm_set1_epi16( int16_t( 0xff00 ) ); }
+};
+
+template<>
+struct Lanes< uint16_t >
+{
+	MNDL_PVAPI_TARGET( "ssse3" ) static __m128i average( __m128i a, __m128i b ) { return _mm_avg_epu16( a, b ); }
+	MNDL_PVAPI_TARGET( "ssse3" ) static __m128i subs( __m128i a, __m128i b ) { return _mm_subs_epu16( a, b ); }
+	MNDL_PVAPI_TARGET( "ssse3" ) static __m128i isZero( __m128i a ) { return _mm_cmpeq_epi16( a, _mm_setzero_si128() ); }
+	MNDL_PVAPI_TARGET( "ssse3" ) static __m128i oddLanes() { return _mm_set1_epi32( int32_t( 0xffff0000 ) ); }
+};
+
+MNDL_PVAPI_TARGET( "ssse3" )
+static inline __m128i select( __m128i mask, __m128i a, __m128i b )
+{
+	return _mm_or_si128( _mm_and_si128( mask, a ), _mm_andnot_si128( mask, b ) );
+}
+
+template< typename T >
+MNDL_PVAPI_TARGET( "ssse3" )
+static inline __m128i load( const T *p )
+{
+	return _mm_loadu_si128( reinterpret_cast< const __m128i * >( p ) );
+}
+
+//! Interpolates the columns from 1 of a row of RGB pixels with BILINEAR or EDGE_AWARE, returns the first column left to do.
+template< typename T >
+MNDL_PVAPI_TARGET( "ssse3" )
+static size_t interpolateRowSsse3( const T *up, const T *row, const T *down, T *dst, size_t width,
+		RowLayout layout, bool redFirst, bool edgeAware )
+{
+	typedef Lanes< T > L;
+	static const InterleaveShuffles< T > sInterleave;
+	const size_t n = 16 / sizeof( T );
+
+	__m128i shuffles[ 3 ][ 3 ];
+	for ( size_t out = 0; out < 3; out++ )
+	{
+		for ( size_t color = 0; color < 3; color++ )
+		{
+			shuffles[ out ][ color ] = _mm_load_si128( reinterpret_cast< const __m128i * >( sInterleave.mShuffles[ out ][ color ] ) );
+		}
+	}
+
+	// the vectors start at odd columns, so the even columns are in the odd lanes
+	const __m128i aMask = layout.aEven ? L::oddLanes() : _mm_xor_si128( L::oddLanes(), _mm_set1_epi8( -1 ) );
+	const bool aFirst = layout.aRed == redFirst;
+
+	size_t x = 1;
+	for ( ; x + n < width; x += n )
+	{
+		const __m128i c = load( row + x );
+		const __m128i l = load( row + x - 1 );
+		const __m128i r = load( row + x + 1 );
+		const __m128i u = load( up + x );
+		const __m128i d = load( down + x );
+
+		const __m128i h = L::average( l, r );
+		const __m128i v = L::average( u, d );
+		const __m128i diagonal = L::average( L::average( load( up + x - 1 ), load( up + x + 1 ) ),
+				L::average( load( down + x - 1 ), load( down + x + 1 ) ) );
+		__m128i cross = L::average( h, v );
+		if ( edgeAware )
+		{
+			const __m128i dh = _mm_or_si128( L::subs( l, r ), L::subs( r, l ) );
+			const __m128i dv = _mm_or_si128( L::subs( u, d ), L::subs( d, u ) );
+			// dh < dv and dv < dh, unsigned compares without SSE4.1
+			const __m128i horizontal = _mm_andnot_si128( L::isZero( L::subs( dv, dh ) ), _mm_set1_epi8( -1 ) );
+			const __m128i vertical = _mm_andnot_si128( L::isZero( L::subs( dh, dv ) ), _mm_set1_epi8( -1 ) );
+			cross = select( horizontal, h, select( vertical, v, cross ) );
+		}
+
+		const __m128i a = select( aMask, c, h );
+		const __m128i g = select( aMask, cross, c );
+		const __m128i o = select( aMask, diagonal, v );
+		const __m128i first = aFirst ? a : o;
+		const __m128i last = aFirst ? o : a;
+
+		T *p = dst + x * 3;
+		for ( size_t out = 0; out < 3; out++ )
+		{
+			__m128i pixels = _mm_or_si128( _mm_or_si128(
+					_mm_shuffle_epi8( first, shuffles[ out ][ 0 ] ),
+					_mm_shuffle_epi8( g, shuffles[ out ][ 1 ] ) ),
+					_mm_shuffle_epi8( last, shuffles[ out ][ 2 ] ) );
+			_mm_storeu_si128( reinterpret_cast< __m128i * >( p + out * n ), pixels );
+		}
+	}
+	return x;
+}
+
+#endif
+
+template< typename T >
+static void demosaicT( const ci::ChannelT< T > &src, BayerPattern pattern, DemosaicMethod method, ci::SurfaceT< T > *dst, ParallelStripes *stripes )
+{
+	const size_t width = std::min( src.getWidth(), dst->getWidth() );
+	const size_t height = std::min( src.getHeight(), dst->getHeight() );
+	if ( width == 0 || height == 0 )
+	{
+		return;
+	}
+
+	PixelLayout pixel;
+	pixel.pixelInc = dst->getPixelInc();
+	pixel.redOffset = dst->getRedOffset();
+	pixel.greenOffset = dst->getGreenOffset();
+	pixel.blueOffset = dst->getBlueOffset();
+	const int alphaOffset = dst->hasAlpha() ? dst->getAlphaOffset() : -1;
+
+	bool vectorized = false;
+#if MNDL_PVAPI_X86_SIMD
+	vectorized = method != DemosaicMethod::NEAREST && getSimdLevel() >= SimdLevel::SSSE3 &&
+		pixel.pixelInc == 3 && pixel.greenOffset == 1;
+#endif
+
+	const uint8_t *srcData = reinterpret_cast< const uint8_t * >( src.getData() );
+	uint8_t *dstData = reinterpret_cast< uint8_t * >( dst->getData() );
+	const ptrdiff_t srcRowBytes = src.getRowBytes();
+	const ptrdiff_t dstRowBytes = dst->getRowBytes();
+
+	ParallelStripes::forRows( stripes, height,
+			[ & ]( size_t beginRow, size_t endRow )
+			{
+				for ( size_t y = beginRow; y < endRow; y++ )
+				{
+					const size_t upRow = y > 0 ? y - 1 : std::min< size_t >( 1, height - 1 );
+					const size_t downRow = y + 1 < height ? y + 1 : upRow;
+					const T *up = reinterpret_cast< const T * >( srcData + upRow * srcRowBytes );
+					const T *row = reinterpret_cast< const T * >( srcData + y * srcRowBytes );
+					const T *down = reinterpret_cast< const T * >( srcData + downRow * srcRowBytes );
+					T *dstRow = reinterpret_cast< T * >( dstData + y * dstRowBytes );
+					const RowLayout layout = getRowLayout( pattern, y );
+					const bool oddRow = ( y & 1 ) != 0;
+
+					size_t done = 0;
+#if MNDL_PVAPI_X86_SIMD
+					if ( vectorized )
+					{
+						interpolateRowScalar( up, row, down, dstRow, 0, 1, width, layout, pixel, method, oddRow );
+						done = interpolateRowSsse3( up, row, down, dstRow, width, layout, pixel.redOffset == 0,
+								method == DemosaicMethod::EDGE_AWARE );
+					}
+#endif
+					interpolateRowScalar( up, row, down, dstRow, done, width, width, layout, pixel, method, oddRow );
+
+					if ( alphaOffset >= 0 )
+					{
+						for ( size_t x = 0; x < width; x++ )
+						{
+							dstRow[ x * pixel.pixelInc + alphaOffset ] = std::numeric_limits< T >::max();
+						}
+					}
+				}
+			} );
+}
+
+void demosaic( const ci::Channel8u &src, BayerPattern pattern, DemosaicMethod method, ci::Surface8u *dst, ParallelStripes *stripes )
+{
+	demosaicT( src, pattern, method, dst, stripes );
+}
+
+void demosaic( const ci::Channel16u &src, BayerPattern pattern, DemosaicMethod method, ci::Surface16u *dst, ParallelStripes *stripes )
+{
+	demosaicT( src, pattern, method, dst, stripes );
+}
+
+} } // mndl::pvapi
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "cinder/Channel.h"
+#include "cinder/Surface.h"
+
+#include "ParallelStripes.h"
+
+namespace mndl { namespace pvapi {
+
+//! Color filter layout of the top left 2x2 pixels of a Bayer mosaic, in the order of tPvBayerPattern.
+enum class BayerPattern
+{
+	RGGB,
+	GBRG,
+	GRBG,
+	BGGR
+};
+
+//! Interpolation of the missing colors, from the fastest to the best quality.
+enum class DemosaicMethod
+{
+	//! each 2x2 block of the mosaic shares its red and blue values, green is taken from the same row
+	NEAREST,
+	//! average of the nearest neighbors of each color
+	BILINEAR,
+	//! like BILINEAR but green is interpolated along the edges instead of across them
+	EDGE_AWARE
+};
+
+//! Interpolates the Bayer mosaic \a src with \a pattern into the color channels of \a dst, splitting the rows over \a stripes if not null.
+void demosaic( const ci::Channel8u &src, BayerPattern pattern, DemosaicMethod method, ci::Surface8u *dst, ParallelStripes *stripes = nullptr );
+//! Interpolates a 16-bit Bayer mosaic like the 8-bit version.
+void demosaic( const ci::Channel16u &src, BayerPattern pattern, DemosaicMethod method, ci::Surface16u *dst, ParallelStripes *stripes = nullptr );
+
+} } // mndl::pvapi
@@ -0,0 +1,251 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+
+#include "FlatFieldCorrection.h"
+#include "PixelConversion.h"
+#include "Simd.h"
+
+namespace mndl { namespace pvapi {
+
+FlatFieldCorrection::FlatFieldCorrection( int32_t width, int32_t height, uint32_t bitDepth ) :
+	mWidth( std::max( width, 0 ) ), mHeight( std::max( height, 0 ) ),
+	mBitDepth( std::min< uint32_t >( std::max< uint32_t >( bitDepth, 1 ), 16 ) )
+{
+	mFullScale = uint16_t( ( 1u << mBitDepth ) - 1 );
+	mDark.assign( size_t( mWidth ) * mHeight, 0 );
+	mGain.assign( size_t( mWidth ) * mHeight, uint16_t( 1u << kGainBits ) );
+}
+
+void FlatFieldCorrection::setDarkFromSums( const std::vector< uint32_t > &sums, size_t numFrames )
+{
+	if ( sums.size() != mDark.size() || numFrames == 0 )
+	{
+		return;
+	}
+
+	for ( size_t i = 0; i < mDark.size(); i++ )
+	{
+		mDark[ i ] = uint16_t( ( sums[ i ] + numFrames / 2 ) / numFrames );
+	}
+	mHasDark = true;
+}
+
+void FlatFieldCorrection::setGainFromSums( const std::vector< uint32_t > &sums, size_t numFrames, bool mosaic )
+{
+	if ( sums.size() != mGain.size() || numFrames == 0 )
+	{
+		return;
+	}
+
+	// the mean level above the dark frame of each of the 2x2 pixels of the mosaic
+	std::vector< double > levels( sums.size() );
+	double phaseSums[ 4 ] = { 0.0, 0.0, 0.0, 0.0 };
+	size_t phaseCounts[ 4 ] = { 0, 0, 0, 0 };
+	for ( int32_t y = 0; y < mHeight; y++ )
+	{
+		for ( int32_t x = 0; x < mWidth; x++ )
+		{
+			const size_t i = size_t( y ) * mWidth + x;
+			const size_t phase = mosaic ? ( y & 1 ) * 2 + ( x & 1 ) : 0;
+			levels[ i ] = double( sums[ i ] ) / numFrames - mDark[ i ];
+			phaseSums[ phase ] += levels[ i ];
+			phaseCounts[ phase ]++;
+		}
+	}
+
+	const double maxGain = double( 0xffff ) / ( 1u << kGainBits );
+	for ( int32_t y = 0; y < mHeight; y++ )
+	{
+		for ( int32_t x = 0; x < mWidth; x++ )
+		{
+			const size_t i = size_t( y ) * mWidth + x;
+			const size_t phase = mosaic ? ( y & 1 ) * 2 + ( x & 1 ) : 0;
+			const double mean = phaseSums[ phase ] / std::max< size_t >( phaseCounts[ phase ], 1 );
+			// dead pixels keep unity gain
+			const double gain = levels[ i ] > 0.5 ? std::min( mean / levels[ i ], maxGain ) : 1.0;
+			mGain[ i ] = uint16_t( std::lround( gain * ( 1u << kGainBits ) ) );
+		}
+	}
+	mHasFlat = true;
+}
+
+#if MNDL_PVAPI_X86_SIMD
+
+MNDL_PVAPI_TARGET( "sse2" )
+static size_t correctRowSse2( uint16_t *row, const uint16_t *dark, const uint16_t *gain, size_t n, uint16_t fullScale )
+{
+	const __m128i round = _mm_set1_epi32( 1 << ( FlatFieldCorrection::kGainBits - 1 ) );
+	const __m128i bias = _mm_set1_epi32( 0x8000 );
+	const __m128i sign = _mm_set1_epi16( int16_t( 0x8000 ) );
+	const __m128i full = _mm_set1_epi16( int16_t( fullScale ) );
+
+	size_t i = 0;
+	for ( ; i + 8 <= n; i += 8 )
+	{
+		__m128i *p = reinterpret_cast< __m128i * >( row + i );
+		__m128i d = _mm_subs_epu16( _mm_loadu_si128( p ), _mm_loadu_si128( reinterpret_cast< const __m128i * >( dark + i ) ) );
+		__m128i g = _mm_loadu_si128( reinterpret_cast< const __m128i * >( gain + i ) );
+		// the 32-bit products from their low and high halves
+		__m128i lo = _mm_mullo_epi16( d, g );
+		__m128i hi = _mm_mulhi_epu16( d, g );
+		__m128i p0 = _mm_srli_epi32( _mm_add_epi32( _mm_unpacklo_epi16( lo, hi ), round ), FlatFieldCorrection::kGainBits );
+		__m128i p1 = _mm_srli_epi32( _mm_add_epi32( _mm_unpackhi_epi16( lo, hi ), round ), FlatFieldCorrection::kGainBits );
+		// unsigned saturation with the signed pack of SSE2
+		__m128i v = _mm_xor_si128( _mm_packs_epi32( _mm_sub_epi32( p0, bias ), _mm_sub_epi32( p1, bias ) ), sign );
+		// min( v, fullScale ) without SSE4.1
+		v = _mm_sub_epi16( v, _mm_subs_epu16( v, full ) );
+		_mm_storeu_si128( p, v );
+	}
+	return i;
+}
+
+#endif
+
+void FlatFieldCorrection::correctRow( uint16_t *row, size_t y, size_t n ) const
+{
+	n = std::min( n, size_t( mWidth ) );
+	const uint16_t *dark = mDark.data() + y * mWidth;
+	const uint16_t *gain = mGain.data() + y * mWidth;
+
+	size_t done = 0;
+#if MNDL_PVAPI_X86_SIMD
+	if ( getSimdLevel() >= SimdLevel::SSE2 )
+	{
+		done = correctRowSse2( row, dark, gain, n, mFullScale );
+	}
+#endif
+	const uint32_t round = 1u << ( kGainBits - 1 );
+	for ( size_t i = done; i < n; i++ )
+	{
+		uint32_t d = row[ i ] > dark[ i ] ? row[ i ] - dark[ i ] : 0;
+		row[ i ] = uint16_t( std::min< uint32_t >( ( d * gain[ i ] + round ) >> kGainBits, mFullScale ) );
+	}
+}
+
+void FlatFieldCorrection::correctRow( uint8_t *row, size_t y, size_t n ) const
+{
+	// widened in chunks through the stack
+	const size_t kChunk = 1024;
+	uint16_t levels[ kChunk ];
+	n = std::min( n, size_t( mWidth ) );
+	for ( size_t x = 0; x < n; x += kChunk )
+	{
+		const size_t count = std::min( kChunk, n - x );
+		std::copy( row + x, row + x + count, levels );
+		correctRow( levels, y, count );
+		std::transform( levels, levels + count, row + x, []( uint16_t v ) { return uint8_t( std::min< uint16_t >( v, 255 ) ); } );
+	}
+}
+
+template< typename T >
+static void applyCorrection( const FlatFieldCorrection &correction, ci::ChannelT< T > *channel, FrameStatistics *stats, ParallelStripes *stripes )
+{
+	const size_t width = std::min( channel->getWidth(), correction.getWidth() );
+	std::mutex mutex;
+	ParallelStripes::forRows( stripes, std::min( channel->getHeight(), correction.getHeight() ),
+			[ & ]( size_t beginRow, size_t endRow )
+			{
+				StatisticsAccumulator accumulator( stats ? stats->mBitDepth : 16 );
+				for ( size_t y = beginRow; y < endRow; y++ )
+				{
+					T *row = reinterpret_cast< T * >( reinterpret_cast< uint8_t * >( channel->getData() ) + y * channel->getRowBytes() );
+					correction.correctRow( row, y, width );
+					if ( stats )
+					{
+						accumulator.addRow( row, width );
+					}
+				}
+
+				if ( stats )
+				{
+					std::lock_guard< std::mutex > lock( mutex );
+					accumulator.mergeInto( stats );
+				}
+			} );
+}
+
+void FlatFieldCorrection::apply( ci::Channel8u *channel, FrameStatistics *stats, ParallelStripes *stripes ) const
+{
+	applyCorrection( *this, channel, stats, stripes );
+}
+
+void FlatFieldCorrection::apply( ci::Channel16u *channel, FrameStatistics *stats, ParallelStripes *stripes ) const
+{
+	applyCorrection( *this, channel, stats, stripes );
+}
+
+//! File header of the saved maps.
+struct FlatFieldHeader
+{
+	char mMagic[ 8 ];
+	int32_t mWidth;
+	int32_t mHeight;
+	uint32_t mBitDepth;
+	uint8_t mHasDark;
+	uint8_t mHasFlat;
+	uint8_t mPadding[ 2 ];
+};
+
+static const char kFlatFieldMagic[ 8 ] = { 'P', 'V', 'F', 'F', 'C', '0', '0', '1' };
+
+bool FlatFieldCorrection::save( const ci::fs::path &path ) const
+{
+	std::ofstream file( path.string(), std::ios::binary );
+	if ( ! file )
+	{
+		return false;
+	}
+
+	FlatFieldHeader header = {};
+	std::memcpy( header.mMagic, kFlatFieldMagic, sizeof( kFlatFieldMagic ) );
+	header.mWidth = mWidth;
+	header.mHeight = mHeight;
+	header.mBitDepth = mBitDepth;
+	header.mHasDark = mHasDark;
+	header.mHasFlat = mHasFlat;
+	file.write( reinterpret_cast< const char * >( &header ), sizeof( header ) );
+	file.write( reinterpret_cast< const char * >( mDark.data() ), mDark.size() * sizeof( uint16_t ) );
+	file.write( reinterpret_cast< const char * >( mGain.data() ), mGain.size() * sizeof( uint16_t ) );
+	return bool( file );
+}
+
+std::shared_ptr< FlatFieldCorrection > FlatFieldCorrection::load( const ci::fs::path &path )
+{
+	std::ifstream file( path.string(), std::ios::binary );
+	FlatFieldHeader header;
+	if ( ! file.read( reinterpret_cast< char * >( &header ), sizeof( header ) ) ||
+		 std::memcmp( header.mMagic, kFlatFieldMagic, sizeof( kFlatFieldMagic ) ) != 0 ||
+		 header.mWidth <= 0 || header.mHeight <= 0 || header.mBitDepth == 0 || header.mBitDepth > 16 )
+	{
+		return std::shared_ptr< FlatFieldCorrection >();
+	}
+
+	// the dark frame and the gains of the size of the header must make up the
+	// rest of the file, checked before allocating them
+	const std::streamoff headerEnd = file.tellg();
+	file.seekg( 0, std::ios::end );
+	const std::streamoff fileEnd = file.tellg();
+	file.seekg( headerEnd );
+	const uint64_t numBytes = uint64_t( fileEnd - headerEnd );
+	const uint64_t numPixels = uint64_t( header.mWidth ) * uint64_t( header.mHeight );
+	if ( ! file || fileEnd < headerEnd || numBytes % ( 2 * sizeof( uint16_t ) ) != 0 || numBytes / ( 2 * sizeof( uint16_t ) ) != numPixels )
+	{
+		return std::shared_ptr< FlatFieldCorrection >();
+	}
+
+	std::shared_ptr< FlatFieldCorrection > correction = std::make_shared< FlatFieldCorrection >( header.mWidth, header.mHeight, header.mBitDepth );
+	file.read( reinterpret_cast< char * >( correction->mDark.data() ), correction->mDark.size() * sizeof( uint16_t ) );
+	file.read( reinterpret_cast< char * >( correction->mGain.data() ), correction->mGain.size() * sizeof( uint16_t ) );
+	if ( ! file )
+	{
+		return std::shared_ptr< FlatFieldCorrection >();
+	}
+	correction->mHasDark = header.mHasDark != 0;
+	correction->mHasFlat = header.mHasFlat != 0;
+	return correction;
+}
+
+} } // mndl::pvapi
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "cinder/Channel.h"
+#include "cinder/Filesystem.h"
+
+#include "FrameStatistics.h"
+#include "ParallelStripes.h"
+
+namespace mndl { namespace pvapi {
+
+typedef std::shared_ptr< const class FlatFieldCorrection > FlatFieldCorrectionRef;
+
+//! Dark frame and flat field correction of the levels of a sensor. Each level
+//! is corrected as ( v - dark ) * gain >> kGainBits and clamped to the full
+//! scale of the bit depth, with the dark level and the fixed point gain of its
+//! pixel.
+class FlatFieldCorrection
+{
+  public:
+	//! fractional bits of the gains, gains below 4 can be represented
+	static const uint32_t kGainBits = 14;
+
+	//! Creates a correction of \a width x \a height levels of \a bitDepth bits, without dark frame and with unity gains.
+	FlatFieldCorrection( int32_t width, int32_t height, uint32_t bitDepth );
+
+	int32_t getWidth() const { return mWidth; }
+	int32_t getHeight() const { return mHeight; }
+	uint32_t getBitDepth() const { return mBitDepth; }
+
+	bool hasDark() const { return mHasDark; }
+	bool hasFlat() const { return mHasFlat; }
+	//! Returns the dark level of each pixel, row by row.
+	const std::vector< uint16_t > & getDark() const { return mDark; }
+	//! Returns the gain of each pixel with kGainBits fractional bits, row by row.
+	const std::vector< uint16_t > & getGain() const { return mGain; }
+
+	//! Sets the dark frame to the mean of \a numFrames frames summed in \a sums.
+	void setDarkFromSums( const std::vector< uint32_t > &sums, size_t numFrames );
+	//! Sets the gains from the sum of \a numFrames frames of a uniformly lit
+	//! target, with the dark frame subtracted. The gains scale each pixel to
+	//! the mean level, with \a mosaic to the mean of its color in a Bayer
+	//! mosaic so that the color balance is kept.
+	void setGainFromSums( const std::vector< uint32_t > &sums, size_t numFrames, bool mosaic );
+
+	//! Corrects \a n levels of the row \a y in place.
+	void correctRow( uint16_t *row, size_t y, size_t n ) const;
+	void correctRow( uint8_t *row, size_t y, size_t n ) const;
+
+	//! Corrects \a channel of at most the size of the correction in place, adding the corrected rows to \a stats if not null.
+	void apply( ci::Channel8u *channel, FrameStatistics *stats, ParallelStripes *stripes = nullptr ) const;
+	void apply( ci::Channel16u *channel, FrameStatistics *stats, ParallelStripes *stripes = nullptr ) const;
+
+	//! Writes the maps to \a path in the byte order of the host, returns false on failure.
+	bool save( const ci::fs::path &path ) const;
+	//! Reads maps written by save(), returns null on failure or if the size of the file does not match its header.
+	static std::shared_ptr< FlatFieldCorrection > load( const ci::fs::path &path );
+
+  private:
+	int32_t mWidth;
+	int32_t mHeight;
+	uint32_t mBitDepth;
+	uint16_t mFullScale;
+	bool mHasDark = false;
+	bool mHasFlat = false;
+	std::vector< uint16_t > mDark;
+	std::vector< uint16_t > mGain;
+};
+
+} } // mndl::pvapi
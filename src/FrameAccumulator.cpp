@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <cmath>
+
+#include "FrameAccumulator.h"
+#include "PixelConversion.h"
+#include "Simd.h"
+
+namespace mndl { namespace pvapi {
+
+const size_t FrameAccumulator::kMaxFrames;
+const size_t FrameAccumulator::kMaxHistoryBytes;
+
+size_t FrameAccumulator::getMaxFrames( int32_t width, int32_t height )
+{
+	const size_t frameBytes = size_t( std::max( width, 1 ) ) * size_t( std::max( height, 1 ) ) * sizeof( uint16_t );
+	return std::min( std::max< size_t >( kMaxHistoryBytes / frameBytes, 1 ), kMaxFrames );
+}
+
+FrameAccumulator::FrameAccumulator( int32_t width, int32_t height, size_t numFrames ) :
+	mWidth( std::max( width, 0 ) ), mHeight( std::max( height, 0 ) ),
+	mNumFrames( std::min( std::max< size_t >( numFrames, 1 ), getMaxFrames( width, height ) ) )
+{
+	mSums.assign( size_t( mWidth ) * mHeight, 0 );
+	mHistory.assign( mNumFrames * mWidth * mHeight, 0 );
+}
+
+void FrameAccumulator::reset()
+{
+	std::fill( mSums.begin(), mSums.end(), 0 );
+	mNumAccumulated = 0;
+	mNextFrame = 0;
+}
+
+// The sums of up to kMaxFrames 16-bit levels stay below 2^24, so they convert
+// to floats exactly and the mean is the sum times the reciprocal of the
+// number of frames, rounded to the nearest level for the 16-bit mean. The
+// frame leaving the sums is read from the history slot the new one replaces.
+
+#if MNDL_PVAPI_X86_SIMD
+
+MNDL_PVAPI_TARGET( "sse2" )
+static size_t accumulateRowSse2( const uint16_t *src, uint16_t *history, uint32_t *sums, size_t n, bool subtract,
+		float scale, uint16_t *mean16u, float *mean32f )
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i bias = _mm_set1_epi32( 0x8000 );
+	const __m128i sign = _mm_set1_epi16( int16_t( 0x8000 ) );
+	const __m128 scales = _mm_set1_ps( scale );
+
+	size_t i = 0;
+	for ( ; i + 8 <= n; i += 8 )
+	{
+		__m128i v = _mm_loadu_si128( reinterpret_cast< const __m128i * >( src + i ) );
+		__m128i *h = reinterpret_cast< __m128i * >( history + i );
+		__m128i old = subtract ? _mm_loadu_si128( h ) : zero;
+		_mm_storeu_si128( h, v );
+
+		__m128i *s = reinterpret_cast< __m128i * >( sums + i );
+		__m128i s0 = _mm_add_epi32( _mm_loadu_si128( s ), _mm_sub_epi32( _mm_unpacklo_epi16( v, zero ), _mm_unpacklo_epi16( old, zero ) ) );
+		__m128i s1 = _mm_add_epi32( _mm_loadu_si128( s + 1 ), _mm_sub_epi32( _mm_unpackhi_epi16( v, zero ), _mm_unpackhi_epi16( old, zero ) ) );
+		_mm_storeu_si128( s, s0 );
+		_mm_storeu_si128( s + 1, s1 );
+
+		__m128 m0 = _mm_mul_ps( _mm_cvtepi32_ps( s0 ), scales );
+		__m128 m1 = _mm_mul_ps( _mm_cvtepi32_ps( s1 ), scales );
+		if ( mean32f )
+		{
+			_mm_storeu_ps( mean32f + i, m0 );
+			_mm_storeu_ps( mean32f + i + 4, m1 );
+		}
+		if ( mean16u )
+		{
+			// unsigned pack with the signed pack of SSE2
+			__m128i r = _mm_packs_epi32( _mm_sub_epi32( _mm_cvtps_epi32( m0 ), bias ), _mm_sub_epi32( _mm_cvtps_epi32( m1 ), bias ) );
+			_mm_storeu_si128( reinterpret_cast< __m128i * >( mean16u + i ), _mm_xor_si128( r, sign ) );
+		}
+	}
+	return i;
+}
+
+#endif
+
+static void accumulateRow( const uint16_t *src, uint16_t *history, uint32_t *sums, size_t n, bool subtract,
+		float scale, uint16_t *mean16u, float *mean32f )
+{
+	size_t done = 0;
+#if MNDL_PVAPI_X86_SIMD
+	if ( getSimdLevel() >= SimdLevel::SSE2 )
+	{
+		done = accumulateRowSse2( src, history, sums, n, subtract, scale, mean16u, mean32f );
+	}
+#endif
+	for ( size_t i = done; i < n; i++ )
+	{
+		sums[ i ] += src[ i ] - ( subtract ? history[ i ] : 0 );
+		history[ i ] = src[ i ];
+		const float mean = float( sums[ i ] ) * scale;
+		if ( mean32f )
+		{
+			mean32f[ i ] = mean;
+		}
+		if ( mean16u )
+		{
+			mean16u[ i ] = uint16_t( std::lrint( mean ) );
+		}
+	}
+}
+
+static void accumulateRow( const uint8_t *src, uint16_t *history, uint32_t *sums, size_t n, bool subtract,
+		float scale, uint16_t *mean16u, float *mean32f )
+{
+	// widened in chunks through the stack
+	const size_t kChunk = 1024;
+	uint16_t levels[ kChunk ];
+	for ( size_t x = 0; x < n; x += kChunk )
+	{
+		const size_t count = std::min( kChunk, n - x );
+		std::copy( src + x, src + x + count, levels );
+		accumulateRow( levels, history + x, sums + x, count, subtract, scale,
+				mean16u ? mean16u + x : nullptr, mean32f ? mean32f + x : nullptr );
+	}
+}
+
+template< typename T >
+static T * getRow( ci::ChannelT< T > *channel, size_t y )
+{
+	return channel ? reinterpret_cast< T * >( reinterpret_cast< uint8_t * >( channel->getData() ) + y * channel->getRowBytes() ) : nullptr;
+}
+
+template< typename T >
+void FrameAccumulator::addChannel( const ci::ChannelT< T > &channel, ci::Channel16u *mean16u, ci::Channel32f *mean32f, ParallelStripes *stripes )
+{
+	if ( channel.getWidth() != mWidth || channel.getHeight() != mHeight )
+	{
+		mWidth = channel.getWidth();
+		mHeight = channel.getHeight();
+		mSums.assign( size_t( mWidth ) * mHeight, 0 );
+		mHistory.assign( mNumFrames * mWidth * mHeight, 0 );
+		mNumAccumulated = 0;
+		mNextFrame = 0;
+	}
+	if ( mean16u && ( mean16u->getWidth() != mWidth || mean16u->getHeight() != mHeight ) )
+	{
+		mean16u = nullptr;
+	}
+	if ( mean32f && ( mean32f->getWidth() != mWidth || mean32f->getHeight() != mHeight ) )
+	{
+		mean32f = nullptr;
+	}
+
+	const bool subtract = mNumAccumulated == mNumFrames;
+	const size_t numAccumulated = subtract ? mNumFrames : mNumAccumulated + 1;
+	const float scale = 1.0f / float( numAccumulated );
+	const size_t width = mWidth;
+	uint16_t *history = mHistory.data() + mNextFrame * width * mHeight;
+	ParallelStripes::forRows( stripes, mHeight,
+			[ & ]( size_t beginRow, size_t endRow )
+			{
+				for ( size_t y = beginRow; y < endRow; y++ )
+				{
+					const T *src = reinterpret_cast< const T * >( reinterpret_cast< const uint8_t * >( channel.getData() ) + y * channel.getRowBytes() );
+					accumulateRow( src, history + y * width, mSums.data() + y * width, width, subtract, scale,
+							getRow( mean16u, y ), getRow( mean32f, y ) );
+				}
+			} );
+
+	mNumAccumulated = numAccumulated;
+	mNextFrame = ( mNextFrame + 1 ) % mNumFrames;
+}
+
+void FrameAccumulator::add( const ci::Channel8u &channel, ci::Channel16u *mean16u, ci::Channel32f *mean32f, ParallelStripes *stripes )
+{
+	addChannel( channel, mean16u, mean32f, stripes );
+}
+
+void FrameAccumulator::add( const ci::Channel16u &channel, ci::Channel16u *mean16u, ci::Channel32f *mean32f, ParallelStripes *stripes )
+{
+	addChannel( channel, mean16u, mean32f, stripes );
+}
+
+} } // mndl::pvapi
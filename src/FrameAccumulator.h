@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "cinder/Channel.h"
+
+#include "ParallelStripes.h"
+
+namespace mndl { namespace pvapi {
+
+typedef std::shared_ptr< class FrameAccumulator > FrameAccumulatorRef;
+
+//! Rolling sum of the levels of the last frames for averaging out noise. Each
+//! new frame is added to 32-bit sums and the oldest one subtracted, so the
+//! cost per frame does not depend on the number of frames averaged. The last
+//! frames are kept with 16 bits per level, so the history takes the number of
+//! frames times 2 bytes per level, capped by kMaxHistoryBytes.
+class FrameAccumulator
+{
+  public:
+	//! the most frames averaged, their sums are exact as floats
+	static const size_t kMaxFrames = 256;
+	//! the most memory the history of the last frames takes, 107 frames of 2448x2048
+	static const size_t kMaxHistoryBytes = size_t( 1 ) << 30;
+
+	//! Returns the most frames of \a width x \a height levels averaged, up to kMaxFrames and within kMaxHistoryBytes.
+	static size_t getMaxFrames( int32_t width, int32_t height );
+
+	//! Creates an accumulator averaging the last \a numFrames frames of \a width x \a height levels, up to getMaxFrames().
+	FrameAccumulator( int32_t width, int32_t height, size_t numFrames );
+
+	int32_t getWidth() const { return mWidth; }
+	int32_t getHeight() const { return mHeight; }
+	//! Returns the number of frames averaged once enough frames were added.
+	size_t getNumFrames() const { return mNumFrames; }
+	//! Returns the number of frames in the sums, less than getNumFrames() after a reset.
+	size_t getNumAccumulated() const { return mNumAccumulated; }
+
+	//! Empties the sums, the next frame starts a new average.
+	void reset();
+
+	//! Adds \a channel, replacing the oldest frame once the sums are full,
+	//! and writes the mean levels to \a mean16u and \a mean32f if not null.
+	//! The accumulator is reset if the size of \a channel differs.
+	void add( const ci::Channel8u &channel, ci::Channel16u *mean16u, ci::Channel32f *mean32f, ParallelStripes *stripes = nullptr );
+	void add( const ci::Channel16u &channel, ci::Channel16u *mean16u, ci::Channel32f *mean32f, ParallelStripes *stripes = nullptr );
+
+  private:
+	template< typename T >
+	void addChannel( const ci::ChannelT< T > &channel, ci::Channel16u *mean16u, ci::Channel32f *mean32f, ParallelStripes *stripes );
+
+	int32_t mWidth;
+	int32_t mHeight;
+	size_t mNumFrames;
+	size_t mNumAccumulated = 0;
+	//! slot of the history the next frame is written to
+	size_t mNextFrame = 0;
+	std::vector< uint32_t > mSums;
+	//! the last mNumFrames frames, one after the other
+	std::vector< uint16_t > mHistory;
+};
+
+} } // mndl::pvapi
@@ -0,0 +1,106 @@
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include "FrameAllocator.h"
+
+#if defined( __APPLE__ ) || defined( __linux__ )
+#define MNDL_PVAPI_MMAP 1
+#include <sys/mman.h>
+#if defined( __APPLE__ )
+#include <mach/vm_statistics.h>
+#endif
+#else
+#define MNDL_PVAPI_MMAP 0
+#endif
+
+namespace mndl { namespace pvapi {
+
+#if MNDL_PVAPI_MMAP
+
+static const size_t kHugePageSize = 2 * 1024 * 1024;
+static const size_t kPageSize = 4096;
+
+//! Maps \a bytes of anonymous memory backed by \a hugePages, returns MAP_FAILED on failure.
+static void * mapFrameBuffer( size_t bytes, HugePages hugePages )
+{
+	const int protection = PROT_READ | PROT_WRITE;
+#if defined( __linux__ )
+#if defined( MAP_HUGETLB )
+	if ( hugePages == HugePages::EXPLICIT )
+	{
+		void *data = mmap( nullptr, bytes, protection, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+		if ( data != MAP_FAILED )
+		{
+			return data;
+		}
+	}
+#endif
+	void *data = mmap( nullptr, bytes, protection, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+#if defined( MADV_HUGEPAGE )
+	if ( data != MAP_FAILED && hugePages != HugePages::NONE )
+	{
+		madvise( data, bytes, MADV_HUGEPAGE );
+	}
+#endif
+	return data;
+#else
+	// superpages on macOS, which has no transparent huge pages
+#if defined( VM_FLAGS_SUPERPAGE_SIZE_2MB )
+	if ( hugePages == HugePages::EXPLICIT )
+	{
+		void *data = mmap( nullptr, bytes, protection, MAP_PRIVATE | MAP_ANON, VM_FLAGS_SUPERPAGE_SIZE_2MB, 0 );
+		if ( data != MAP_FAILED )
+		{
+			return data;
+		}
+	}
+#endif
+	return mmap( nullptr, bytes, protection, MAP_PRIVATE | MAP_ANON, -1, 0 );
+#endif
+}
+
+std::shared_ptr< uint8_t > allocateFrameBuffer( size_t bytes, const FrameBufferOptions &options )
+{
+	bytes = std::max< size_t >( bytes, 1 );
+
+	// huge pages and locked buffers are mapped on their own, so that no other
+	// allocation shares their pages
+	if ( options.mHugePages != HugePages::NONE || options.mLock )
+	{
+		const size_t pageSize = options.mHugePages != HugePages::NONE ? kHugePageSize : kPageSize;
+		const size_t mappedBytes = ( bytes + pageSize - 1 ) & ~( pageSize - 1 );
+		void *data = mapFrameBuffer( mappedBytes, options.mHugePages );
+		if ( data == MAP_FAILED )
+		{
+			throw std::bad_alloc();
+		}
+		if ( options.mLock )
+		{
+			mlock( data, mappedBytes );
+		}
+		// unmapping unlocks the pages
+		return std::shared_ptr< uint8_t >( static_cast< uint8_t * >( data ), [ mappedBytes ]( uint8_t *p ) { munmap( p, mappedBytes ); } );
+	}
+
+	void *data = nullptr;
+	if ( posix_memalign( &data, kFrameBufferAlignment, bytes ) != 0 )
+	{
+		throw std::bad_alloc();
+	}
+	return std::shared_ptr< uint8_t >( static_cast< uint8_t * >( data ), []( uint8_t *p ) { std::free( p ); } );
+}
+
+#else
+
+std::shared_ptr< uint8_t > allocateFrameBuffer( size_t bytes, const FrameBufferOptions &options )
+{
+	// aligned within a larger block, without huge pages or locking
+	uint8_t *block = new uint8_t[ std::max< size_t >( bytes, 1 ) + kFrameBufferAlignment ];
+	uint8_t *data = block + kFrameBufferAlignment - reinterpret_cast< uintptr_t >( block ) % kFrameBufferAlignment;
+	return std::shared_ptr< uint8_t >( data, [ block ]( uint8_t * ) { delete [] block; } );
+}
+
+#endif
+
+} } // mndl::pvapi
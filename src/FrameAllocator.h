@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace mndl { namespace pvapi {
+
+//! Page size backing the frame buffers.
+enum class HugePages
+{
+	//! pages of the default size
+	NONE,
+	//! asks the kernel to back the buffers with huge pages where it can, madvise( MADV_HUGEPAGE ) on Linux
+	TRANSPARENT,
+	//! huge pages reserved by the system, MAP_HUGETLB on Linux and superpages
+	//! on macOS, falling back to TRANSPARENT when none are available
+	EXPLICIT
+};
+
+//! Memory layout and backing of the frame buffers of the caches.
+struct FrameBufferOptions
+{
+	//! the rows are padded to a multiple of this many bytes, a power of two,
+	//! 1 packs them tightly
+	size_t mRowAlignment = 64;
+	HugePages mHugePages = HugePages::NONE;
+	//! locks the buffers into memory with mlock so that they are never paged
+	//! out, kept unlocked if the memory lock limit does not allow it
+	bool mLock = false;
+
+	bool operator==( const FrameBufferOptions &other ) const
+	{ return mRowAlignment == other.mRowAlignment && mHugePages == other.mHugePages && mLock == other.mLock; }
+	bool operator!=( const FrameBufferOptions &other ) const { return ! ( *this == other ); }
+};
+
+//! alignment of the start of every frame buffer, a cache line and the widest SIMD vector
+const size_t kFrameBufferAlignment = 64;
+
+//! Returns \a rowBytes rounded up to a multiple of \a alignment.
+inline size_t getPaddedRowBytes( size_t rowBytes, size_t alignment )
+{
+	return alignment > 1 ? ( rowBytes + alignment - 1 ) & ~( alignment - 1 ) : rowBytes;
+}
+
+//! Allocates a frame buffer of \a bytes aligned to kFrameBufferAlignment with
+//! the backing of \a options, freed when its last reference is released.
+//! Throws std::bad_alloc if out of memory.
+std::shared_ptr< uint8_t > allocateFrameBuffer( size_t bytes, const FrameBufferOptions &options );
+
+} } // mndl::pvapi
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+namespace mndl { namespace pvapi {
+
+//! Slot holding the latest published value for a single producer and any
+//! number of readers. Readers never lock or wait for the producer or each
+//! other: a reader pins the slot of the latest value with a counter, checks
+//! that it is still the latest and copies it. The producer writes into a
+//! slot nobody pins and publishes it with a single atomic exchange, it only
+//! waits if more than kNumSlots - 2 readers copy at the same moment. The
+//! slots of older values are emptied when a new one is published, so only
+//! the latest value is kept alive.
+template< typename T >
+class FrameMailboxT
+{
+  public:
+	static const size_t kNumSlots = 8;
+
+	FrameMailboxT()
+	{
+		for ( auto &pins : mPins )
+		{
+			pins.store( 0, std::memory_order_relaxed );
+		}
+	}
+
+	//! Publishes \a value, replacing the previous one if it was not picked up yet. Returns true if a value was replaced unread.
+	bool publish( T value )
+	{
+		const uint64_t latest = mLatest.load( std::memory_order_relaxed );
+		const size_t slot = getFreeSlot( latest & kIndexMask );
+		mSlots[ slot ] = std::move( value );
+		mFilled[ slot ] = true;
+
+		const uint64_t sequence = ( latest >> kSequenceShift ) + 1;
+		mLatest.store( ( sequence << kSequenceShift ) | slot );
+		releaseOldSlots( slot );
+
+		// the previous value was published unread if no reader fetched its sequence
+		return sequence > 1 && mFetched.load() < sequence - 1;
+	}
+
+	//! Returns whether a value was published since the last fetch().
+	bool hasNew() const
+	{
+		return mFetched.load() < ( mLatest.load() >> kSequenceShift );
+	}
+
+	//! Returns the latest published value. \a isNew is set to whether it was published since the last fetch().
+	T fetch( bool *isNew = nullptr )
+	{
+		uint64_t latest = mLatest.load();
+		for ( ;; )
+		{
+			const size_t slot = latest & kIndexMask;
+			mPins[ slot ].fetch_add( 1 );
+			const uint64_t current = mLatest.load();
+			if ( current == latest )
+			{
+				break;
+			}
+			// a newer value was published meanwhile, the slot may be rewritten
+			mPins[ slot ].fetch_sub( 1 );
+			latest = current;
+		}
+
+		const size_t slot = latest & kIndexMask;
+		T value = mSlots[ slot ];
+		mPins[ slot ].fetch_sub( 1 );
+
+		// the sequence fetched only moves forward, a single reader sees a value as new
+		const uint64_t sequence = latest >> kSequenceShift;
+		uint64_t fetched = mFetched.load();
+		while ( fetched < sequence && ! mFetched.compare_exchange_weak( fetched, sequence ) )
+		{
+		}
+		if ( isNew )
+		{
+			*isNew = fetched < sequence;
+		}
+		return value;
+	}
+
+	//! Drops all values, readers get an empty value. Must not be called while publishing.
+	void clear()
+	{
+		publish( T() );
+		mFetched.store( mLatest.load() >> kSequenceShift );
+	}
+
+  private:
+	static const uint64_t kIndexMask = 0xff;
+	static const unsigned kSequenceShift = 8;
+
+	//! Returns a slot other than \a latestSlot which no reader pins.
+	size_t getFreeSlot( size_t latestSlot )
+	{
+		for ( ;; )
+		{
+			for ( size_t i = 1; i < kNumSlots; i++ )
+			{
+				const size_t slot = ( latestSlot + i ) % kNumSlots;
+				if ( mPins[ slot ].load() == 0 )
+				{
+					return slot;
+				}
+			}
+			std::this_thread::yield();
+		}
+	}
+
+	//! Empties the slots other than \a latestSlot which no reader pins, so that they do not keep old values alive.
+	void releaseOldSlots( size_t latestSlot )
+	{
+		for ( size_t slot = 0; slot < kNumSlots; slot++ )
+		{
+			if ( slot != latestSlot && mFilled[ slot ] && mPins[ slot ].load() == 0 )
+			{
+				mSlots[ slot ] = T();
+				mFilled[ slot ] = false;
+			}
+		}
+	}
+
+	T mSlots[ kNumSlots ];
+	//! whether a slot holds a value, only touched by the producer
+	bool mFilled[ kNumSlots ] = {};
+	//! readers copying each slot
+	std::atomic< uint32_t > mPins[ kNumSlots ];
+	//! sequence number of the latest value above kSequenceShift and its slot below, sequence 0 is the empty value
+	std::atomic< uint64_t > mLatest { 0 };
+	//! sequence number of the latest value fetched
+	std::atomic< uint64_t > mFetched { 0 };
+};
+
+template< typename T >
+const size_t FrameMailboxT< T >::kNumSlots;
+
+} } // mndl::pvapi
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace mndl { namespace pvapi {
+
+//! Bounded FIFO of frames between the capture and the consumer. The storage
+//! is allocated up front, what happens when it is full is selected by the
+//! overflow policy.
+template< typename T >
+class FrameQueueT
+{
+  public:
+	enum class Overflow
+	{
+		//! the producer waits for a free slot
+		BLOCK,
+		//! the oldest queued value is dropped
+		DROP_OLDEST,
+		//! the value being pushed is dropped
+		DROP_NEWEST
+	};
+
+	//! Resizes the queue dropping its contents. Must not be called while pushing or popping.
+	void setCapacity( size_t capacity )
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		mSlots.assign( std::max< size_t >( capacity, 1 ), T() );
+		mHead = mSize = 0;
+	}
+	size_t getCapacity() const { return mSlots.size(); }
+
+	void setOverflow( Overflow overflow ) { mOverflow = overflow; }
+	Overflow getOverflow() const { return mOverflow; }
+
+	//! Enables pushing after close().
+	void open()
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		mClosed = false;
+	}
+
+	//! Wakes up a waiting producer and rejects pushes until open() is called. The queued values can still be popped.
+	void close()
+	{
+		{
+			std::lock_guard< std::mutex > lock( mMutex );
+			mClosed = true;
+		}
+		mNotFull.notify_all();
+		mNotEmpty.notify_all();
+	}
+
+	//! Drops the queued values.
+	void clear()
+	{
+		{
+			std::lock_guard< std::mutex > lock( mMutex );
+			while ( mSize > 0 )
+			{
+				popLocked();
+			}
+		}
+		mNotFull.notify_all();
+	}
+
+	//! Appends \a value, returns false if it was dropped.
+	bool push( T value )
+	{
+		{
+			std::unique_lock< std::mutex > lock( mMutex );
+			if ( mClosed )
+			{
+				return false;
+			}
+
+			if ( mSize == mSlots.size() )
+			{
+				switch ( mOverflow )
+				{
+					case Overflow::BLOCK:
+						mNumBlocked.fetch_add( 1, std::memory_order_relaxed );
+						mNotFull.wait( lock, [ this ] { return mClosed || mSize < mSlots.size(); } );
+						if ( mClosed )
+						{
+							return false;
+						}
+						break;
+
+					case Overflow::DROP_OLDEST:
+						popLocked();
+						mNumDroppedOldest.fetch_add( 1, std::memory_order_relaxed );
+						break;
+
+					case Overflow::DROP_NEWEST:
+						mNumDroppedNewest.fetch_add( 1, std::memory_order_relaxed );
+						return false;
+				}
+			}
+
+			mSlots[ ( mHead + mSize ) % mSlots.size() ] = std::move( value );
+			mSize++;
+		}
+		mNotEmpty.notify_one();
+		return true;
+	}
+
+	//! Takes the oldest value, waits up to \a timeout for one. Returns false if the queue stayed empty.
+	bool pop( T &value, std::chrono::milliseconds timeout = std::chrono::milliseconds( 0 ) )
+	{
+		{
+			std::unique_lock< std::mutex > lock( mMutex );
+			if ( ! mNotEmpty.wait_for( lock, timeout, [ this ] { return mSize > 0 || mClosed; } ) || mSize == 0 )
+			{
+				return false;
+			}
+			value = popLocked();
+		}
+		mNotFull.notify_one();
+		return true;
+	}
+
+	size_t size() const
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		return mSize;
+	}
+
+	//! Returns how many times the producer had to wait for a free slot.
+	uint64_t getNumBlocked() const { return mNumBlocked.load( std::memory_order_relaxed ); }
+	//! Returns the number of queued values dropped to make room for a new one.
+	uint64_t getNumDroppedOldest() const { return mNumDroppedOldest.load( std::memory_order_relaxed ); }
+	//! Returns the number of values dropped because the queue was full.
+	uint64_t getNumDroppedNewest() const { return mNumDroppedNewest.load( std::memory_order_relaxed ); }
+
+	void resetCounters()
+	{
+		mNumBlocked = 0;
+		mNumDroppedOldest = 0;
+		mNumDroppedNewest = 0;
+	}
+
+  private:
+	T popLocked()
+	{
+		T value = std::move( mSlots[ mHead ] );
+		mSlots[ mHead ] = T();
+		mHead = ( mHead + 1 ) % mSlots.size();
+		mSize--;
+		return value;
+	}
+
+	std::vector< T > mSlots = std::vector< T >( 1 );
+	size_t mHead = 0;
+	size_t mSize = 0;
+	bool mClosed = false;
+	Overflow mOverflow = Overflow::BLOCK;
+
+	mutable std::mutex mMutex;
+	std::condition_variable mNotFull;
+	std::condition_variable mNotEmpty;
+
+	std::atomic< uint64_t > mNumBlocked { 0 };
+	std::atomic< uint64_t > mNumDroppedOldest { 0 };
+	std::atomic< uint64_t > mNumDroppedNewest { 0 };
+};
+
+} } // mndl::pvapi
@@ -0,0 +1,230 @@
+#include <algorithm>
+#include <mutex>
+
+#include "FrameStatistics.h"
+#include "PixelConversion.h"
+#include "Simd.h"
+
+namespace mndl { namespace pvapi {
+
+FrameStatistics::FrameStatistics( uint32_t bitDepth ) :
+	mBitDepth( std::min< uint32_t >( std::max< uint32_t >( bitDepth, 1 ), 16 ) )
+{
+	mHistogram.fill( 0 );
+}
+
+void FrameStatistics::merge( const FrameStatistics &other )
+{
+	for ( size_t bin = 0; bin < kNumBins; bin++ )
+	{
+		mHistogram[ bin ] += other.mHistogram[ bin ];
+	}
+	mNumPixels += other.mNumPixels;
+	mSum += other.mSum;
+	mMinLevel = std::min( mMinLevel, other.mMinLevel );
+	mMaxLevel = std::max( mMaxLevel, other.mMaxLevel );
+	mNumClipped += other.mNumClipped;
+}
+
+// With up to 8 bits the bins are the levels themselves, so only the histogram
+// is counted and the other statistics are derived from it in mergeInto().
+// Deeper levels are binned by their top 8 bits, the sum, the extremes and the
+// clipped pixels are accumulated next to the histogram, with SSE2 8 pixels at
+// a time. Only the scatter into the histogram stays scalar, it is spread over
+// four histograms so that runs of equal levels do not stall on the same
+// counter.
+
+#if MNDL_PVAPI_X86_SIMD
+
+MNDL_PVAPI_TARGET( "sse2" )
+static size_t addRow16uSse2( const uint16_t *src, size_t n, uint32_t shift, uint16_t fullScale,
+		uint32_t ( *histograms )[ FrameStatistics::kNumBins ], uint64_t *sum, uint64_t *numClipped,
+		uint16_t *minLevel, uint16_t *maxLevel )
+{
+	// the levels are compared as signed with the sign bit flipped, SSE2 has no unsigned 16-bit min and max
+	const __m128i sign = _mm_set1_epi16( int16_t( 0x8000 ) );
+	const __m128i clipThreshold = _mm_set1_epi16( int16_t( ( fullScale - 1 ) ^ 0x8000 ) );
+	const __m128i lastBin = _mm_set1_epi16( int16_t( FrameStatistics::kNumBins - 1 ) );
+	const __m128i ones = _mm_set1_epi16( 1 );
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i shiftCount = _mm_cvtsi32_si128( int( shift ) );
+	__m128i minBiased = _mm_set1_epi16( 0x7fff );
+	__m128i maxBiased = sign;
+	alignas( 16 ) uint16_t bins[ 8 ];
+	alignas( 16 ) uint32_t lanes[ 4 ];
+
+	const size_t end = n & ~size_t( 7 );
+	size_t i = 0;
+	while ( i < end )
+	{
+		// blocks short enough for the 16-bit clip counts and 32-bit sums not to overflow
+		const size_t blockEnd = std::min( end, i + 8 * 8192 );
+		__m128i clipped = zero;
+		__m128i blockSum = zero;
+		for ( ; i < blockEnd; i += 8 )
+		{
+			__m128i v = _mm_loadu_si128( reinterpret_cast< const __m128i * >( src + i ) );
+			__m128i biased = _mm_xor_si128( v, sign );
+			minBiased = _mm_min_epi16( minBiased, biased );
+			maxBiased = _mm_max_epi16( maxBiased, biased );
+			clipped = _mm_sub_epi16( clipped, _mm_cmpgt_epi16( biased, clipThreshold ) );
+			blockSum = _mm_add_epi32( blockSum, _mm_add_epi32( _mm_unpacklo_epi16( v, zero ), _mm_unpackhi_epi16( v, zero ) ) );
+
+			_mm_store_si128( reinterpret_cast< __m128i * >( bins ), _mm_min_epi16( _mm_srl_epi16( v, shiftCount ), lastBin ) );
+			histograms[ 0 ][ bins[ 0 ] ]++;
+			histograms[ 1 ][ bins[ 1 ] ]++;
+			histograms[ 2 ][ bins[ 2 ] ]++;
+			histograms[ 3 ][ bins[ 3 ] ]++;
+			histograms[ 0 ][ bins[ 4 ] ]++;
+			histograms[ 1 ][ bins[ 5 ] ]++;
+			histograms[ 2 ][ bins[ 6 ] ]++;
+			histograms[ 3 ][ bins[ 7 ] ]++;
+		}
+
+		_mm_store_si128( reinterpret_cast< __m128i * >( lanes ), blockSum );
+		*sum += uint64_t( lanes[ 0 ] ) + lanes[ 1 ] + lanes[ 2 ] + lanes[ 3 ];
+		_mm_store_si128( reinterpret_cast< __m128i * >( lanes ), _mm_madd_epi16( clipped, ones ) );
+		*numClipped += uint64_t( lanes[ 0 ] ) + lanes[ 1 ] + lanes[ 2 ] + lanes[ 3 ];
+	}
+
+	if ( end > 0 )
+	{
+		_mm_store_si128( reinterpret_cast< __m128i * >( bins ), _mm_xor_si128( minBiased, sign ) );
+		*minLevel = std::min( *minLevel, *std::min_element( bins, bins + 8 ) );
+		_mm_store_si128( reinterpret_cast< __m128i * >( bins ), _mm_xor_si128( maxBiased, sign ) );
+		*maxLevel = std::max( *maxLevel, *std::max_element( bins, bins + 8 ) );
+	}
+	return end;
+}
+
+#endif
+
+StatisticsAccumulator::StatisticsAccumulator( uint32_t bitDepth ) :
+	mBitDepth( std::min< uint32_t >( std::max< uint32_t >( bitDepth, 1 ), 16 ) )
+{
+	mShift = mBitDepth > 8 ? mBitDepth - 8 : 0;
+	mFullScale = uint16_t( ( 1u << mBitDepth ) - 1 );
+	std::fill( &mHistograms[ 0 ][ 0 ], &mHistograms[ 0 ][ 0 ] + 4 * FrameStatistics::kNumBins, 0 );
+}
+
+//! Counts the bins of levels of at most 8 bits.
+template< typename T >
+static void addBins( const T *src, size_t n, uint32_t ( *histograms )[ FrameStatistics::kNumBins ] )
+{
+	const T lastBin = T( FrameStatistics::kNumBins - 1 );
+	size_t i = 0;
+	for ( ; i + 4 <= n; i += 4 )
+	{
+		histograms[ 0 ][ std::min( src[ i ], lastBin ) ]++;
+		histograms[ 1 ][ std::min( src[ i + 1 ], lastBin ) ]++;
+		histograms[ 2 ][ std::min( src[ i + 2 ], lastBin ) ]++;
+		histograms[ 3 ][ std::min( src[ i + 3 ], lastBin ) ]++;
+	}
+	for ( ; i < n; i++ )
+	{
+		histograms[ 0 ][ std::min( src[ i ], lastBin ) ]++;
+	}
+}
+
+void StatisticsAccumulator::addRow( const uint8_t *src, size_t n )
+{
+	addBins( src, n, mHistograms );
+	mNumPixels += n;
+}
+
+void StatisticsAccumulator::addRow( const uint16_t *src, size_t n )
+{
+	mNumPixels += n;
+	if ( mShift == 0 )
+	{
+		addBins( src, n, mHistograms );
+		return;
+	}
+
+	size_t done = 0;
+#if MNDL_PVAPI_X86_SIMD
+	if ( getSimdLevel() >= SimdLevel::SSE2 )
+	{
+		done = addRow16uSse2( src, n, mShift, mFullScale, mHistograms, &mSum, &mNumClipped, &mMinLevel, &mMaxLevel );
+	}
+#endif
+	const uint32_t lastBin = FrameStatistics::kNumBins - 1;
+	for ( size_t i = done; i < n; i++ )
+	{
+		uint16_t v = src[ i ];
+		mSum += v;
+		mMinLevel = std::min( mMinLevel, v );
+		mMaxLevel = std::max( mMaxLevel, v );
+		mNumClipped += v >= mFullScale ? 1 : 0;
+		mHistograms[ i & 3 ][ std::min< uint32_t >( v >> mShift, lastBin ) ]++;
+	}
+}
+
+void StatisticsAccumulator::mergeInto( FrameStatistics *stats ) const
+{
+	FrameStatistics rows( mBitDepth );
+	for ( size_t bin = 0; bin < FrameStatistics::kNumBins; bin++ )
+	{
+		rows.mHistogram[ bin ] = mHistograms[ 0 ][ bin ] + mHistograms[ 1 ][ bin ] + mHistograms[ 2 ][ bin ] + mHistograms[ 3 ][ bin ];
+	}
+	rows.mNumPixels = mNumPixels;
+
+	if ( mShift == 0 )
+	{
+		for ( size_t bin = 0; bin < FrameStatistics::kNumBins; bin++ )
+		{
+			const uint32_t count = rows.mHistogram[ bin ];
+			if ( count == 0 )
+			{
+				continue;
+			}
+			rows.mSum += uint64_t( bin ) * count;
+			rows.mMinLevel = std::min( rows.mMinLevel, uint16_t( bin ) );
+			rows.mMaxLevel = uint16_t( bin );
+			if ( bin >= mFullScale )
+			{
+				rows.mNumClipped += count;
+			}
+		}
+	}
+	else
+	{
+		rows.mSum = mSum;
+		rows.mMinLevel = mMinLevel;
+		rows.mMaxLevel = mMaxLevel;
+		rows.mNumClipped = mNumClipped;
+	}
+
+	stats->merge( rows );
+}
+
+template< typename T >
+static void computeStatisticsT( const ci::ChannelT< T > &src, FrameStatistics *stats, ParallelStripes *stripes )
+{
+	const size_t width = src.getWidth();
+	std::mutex mutex;
+	ParallelStripes::forRows( stripes, src.getHeight(),
+			[ & ]( size_t beginRow, size_t endRow )
+			{
+				StatisticsAccumulator accumulator( stats->mBitDepth );
+				for ( size_t y = beginRow; y < endRow; y++ )
+				{
+					accumulator.addRow( reinterpret_cast< const T * >( reinterpret_cast< const uint8_t * >( src.getData() ) + y * src.getRowBytes() ), width );
+				}
+
+				std::lock_guard< std::mutex > lock( mutex );
+				accumulator.mergeInto( stats );
+			} );
+}
+
+void computeStatistics( const ci::Channel8u &src, FrameStatistics *stats, ParallelStripes *stripes )
+{
+	computeStatisticsT( src, stats, stripes );
+}
+
+void computeStatistics( const ci::Channel16u &src, FrameStatistics *stats, ParallelStripes *stripes )
+{
+	computeStatisticsT( src, stats, stripes );
+}
+
+} } // mndl::pvapi
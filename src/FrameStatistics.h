@@ -0,0 +1,81 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "cinder/Channel.h"
+
+#include "ParallelStripes.h"
+
+namespace mndl { namespace pvapi {
+
+//! Histogram and exposure statistics of the levels of a frame.
+struct FrameStatistics
+{
+	static const size_t kNumBins = 256;
+
+	explicit FrameStatistics( uint32_t bitDepth = 8 );
+
+	//! Returns the mean level.
+	double getMean() const { return mNumPixels ? double( mSum ) / double( mNumPixels ) : 0.0; }
+	//! Returns the fraction of the pixels at the top of the range of the bit depth.
+	double getClippedFraction() const { return mNumPixels ? double( mNumClipped ) / double( mNumPixels ) : 0.0; }
+	//! Returns the top of the range of the bit depth.
+	uint16_t getFullScale() const { return uint16_t( ( 1u << mBitDepth ) - 1 ); }
+	//! Returns the lowest level of the bin \a bin.
+	uint16_t getBinLevel( size_t bin ) const { return uint16_t( bin << getBinShift() ); }
+	//! Returns the number of bits the levels are shifted by to get their bin.
+	uint32_t getBinShift() const { return mBitDepth > 8 ? mBitDepth - 8 : 0; }
+
+	//! Adds the counts of \a other of the same bit depth.
+	void merge( const FrameStatistics &other );
+
+	//! number of significant bits of the levels, from 1 to 16
+	uint32_t mBitDepth;
+	//! pixel counts of kNumBins equal ranges of the levels, the top 8 significant bits
+	std::array< uint32_t, kNumBins > mHistogram;
+	uint64_t mNumPixels = 0;
+	uint64_t mSum = 0;
+	uint16_t mMinLevel = 0xffff;
+	uint16_t mMaxLevel = 0;
+	//! pixels at or above the full scale
+	uint64_t mNumClipped = 0;
+};
+
+typedef std::shared_ptr< const FrameStatistics > FrameStatisticsRef;
+
+//! Accumulates the statistics of rows, one per thread, so that they can be
+//! computed while the rows are still in the cache from unpacking or copying.
+class StatisticsAccumulator
+{
+  public:
+	explicit StatisticsAccumulator( uint32_t bitDepth );
+
+	//! Adds a row of levels of at most 8 bits.
+	void addRow( const uint8_t *src, size_t n );
+	void addRow( const uint16_t *src, size_t n );
+
+	//! Adds the accumulated rows to \a stats of the same bit depth.
+	void mergeInto( FrameStatistics *stats ) const;
+
+  private:
+	uint32_t mBitDepth;
+	uint32_t mShift;
+	uint16_t mFullScale;
+	//! interleaved histograms, consecutive pixels falling into the same bin do not wait for each other
+	uint32_t mHistograms[ 4 ][ FrameStatistics::kNumBins ];
+	uint64_t mNumPixels = 0;
+	uint64_t mSum = 0;
+	uint16_t mMinLevel = 0xffff;
+	uint16_t mMaxLevel = 0;
+	uint64_t mNumClipped = 0;
+};
+
+//! Computes the statistics of \a src into \a stats, splitting the rows over \a stripes if not null.
+void computeStatistics( const ci::Channel8u &src, FrameStatistics *stats, ParallelStripes *stripes = nullptr );
+//! Computes the statistics of \a src with the bit depth of \a stats.
+void computeStatistics( const ci::Channel16u &src, FrameStatistics *stats, ParallelStripes *stripes = nullptr );
+
+} } // mndl::pvapi
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace mndl { namespace pvapi {
+
+//! Lock-free stack of the indices of the free blocks of a cache, for any
+//! number of threads taking and returning blocks. The head holds the index
+//! of the top block plus one in its low 32 bits and a tag counting the
+//! updates in its high bits, so that a pop does not succeed on a head which
+//! was popped and pushed again in between.
+class FreeList
+{
+  public:
+	//! Creates an empty list of at most \a capacity indices.
+	explicit FreeList( size_t capacity ) :
+		mNext( new std::atomic< uint32_t >[ capacity ] ), mCapacity( capacity )
+	{
+		for ( size_t i = 0; i < capacity; i++ )
+		{
+			mNext[ i ].store( 0, std::memory_order_relaxed );
+		}
+	}
+
+	size_t getCapacity() const { return mCapacity; }
+
+	//! Takes the index of a free block into \a index, returns false if there is none.
+	bool pop( size_t *index )
+	{
+		uint64_t head = mHead.load( std::memory_order_acquire );
+		for ( ;; )
+		{
+			const uint32_t top = uint32_t( head );
+			if ( top == 0 )
+			{
+				return false;
+			}
+
+			// a stale next is rejected by the tag of the head
+			const uint64_t next = mNext[ top - 1 ].load( std::memory_order_relaxed );
+			if ( mHead.compare_exchange_weak( head, ( ( head >> 32 ) + 1 ) << 32 | next,
+						std::memory_order_acquire, std::memory_order_acquire ) )
+			{
+				*index = top - 1;
+				return true;
+			}
+		}
+	}
+
+	//! Returns the block \a index to the list, the writes to the block happen before it is taken again.
+	void push( size_t index )
+	{
+		uint64_t head = mHead.load( std::memory_order_relaxed );
+		for ( ;; )
+		{
+			mNext[ index ].store( uint32_t( head ), std::memory_order_relaxed );
+			if ( mHead.compare_exchange_weak( head, ( ( head >> 32 ) + 1 ) << 32 | ( index + 1 ),
+						std::memory_order_release, std::memory_order_relaxed ) )
+			{
+				return;
+			}
+		}
+	}
+
+  private:
+	//! index plus one of the block below each block in the stack, 0 at the bottom
+	std::unique_ptr< std::atomic< uint32_t >[] > mNext;
+	size_t mCapacity;
+	std::atomic< uint64_t > mHead { 0 };
+};
+
+} } // mndl::pvapi
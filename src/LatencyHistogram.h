@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+//! Define as 1 to record the latency of the capture stages, see CapturePvApi::getLatencyHistogram().
+#if ! defined( MNDL_PVAPI_LATENCY_HISTOGRAMS )
+#define MNDL_PVAPI_LATENCY_HISTOGRAMS 0
+#endif
+
+namespace mndl { namespace pvapi {
+
+//! Histogram of durations with power of two microsecond buckets. Bucket 0
+//! counts durations below 1us, bucket i durations in [2^(i-1), 2^i) us.
+//! Samples are added and read with relaxed atomics, so any thread can read
+//! or reset it while it is being filled.
+class LatencyHistogram
+{
+  public:
+	typedef std::chrono::steady_clock Clock;
+
+	static const size_t kNumBuckets = 32;
+
+	LatencyHistogram() { reset(); }
+
+	void add( Clock::duration duration )
+	{
+		uint64_t ns = uint64_t( std::max< Clock::rep >( std::chrono::duration_cast< std::chrono::nanoseconds >( duration ).count(), 0 ) );
+		uint64_t us = ns / 1000;
+		size_t bucket = 0;
+		while ( us != 0 && bucket < kNumBuckets - 1 )
+		{
+			us >>= 1;
+			bucket++;
+		}
+
+		mBuckets[ bucket ].fetch_add( 1, std::memory_order_relaxed );
+		mNumSamples.fetch_add( 1, std::memory_order_relaxed );
+		mTotalNs.fetch_add( ns, std::memory_order_relaxed );
+		uint64_t maxNs = mMaxNs.load( std::memory_order_relaxed );
+		while ( ns > maxNs && ! mMaxNs.compare_exchange_weak( maxNs, ns, std::memory_order_relaxed ) )
+		{
+		}
+	}
+
+	void reset()
+	{
+		for ( auto &bucket : mBuckets )
+		{
+			bucket.store( 0, std::memory_order_relaxed );
+		}
+		mNumSamples.store( 0, std::memory_order_relaxed );
+		mTotalNs.store( 0, std::memory_order_relaxed );
+		mMaxNs.store( 0, std::memory_order_relaxed );
+	}
+
+	//! Returns the number of samples in \a bucket.
+	uint64_t getCount( size_t bucket ) const { return mBuckets[ bucket ].load( std::memory_order_relaxed ); }
+	//! Returns the exclusive upper bound of \a bucket in microseconds.
+	static uint64_t getBucketUpperBound( size_t bucket ) { return uint64_t( 1 ) << bucket; }
+
+	uint64_t getNumSamples() const { return mNumSamples.load( std::memory_order_relaxed ); }
+	Clock::duration getMean() const
+	{
+		uint64_t n = getNumSamples();
+		return std::chrono::duration_cast< Clock::duration >( std::chrono::nanoseconds( n ? mTotalNs.load( std::memory_order_relaxed ) / n : 0 ) );
+	}
+	Clock::duration getMax() const
+	{
+		return std::chrono::duration_cast< Clock::duration >( std::chrono::nanoseconds( mMaxNs.load( std::memory_order_relaxed ) ) );
+	}
+
+	//! Returns the upper bound in microseconds of the bucket the \a percentile (0-100) falls into.
+	uint64_t getPercentile( double percentile ) const
+	{
+		uint64_t n = getNumSamples();
+		uint64_t rank = uint64_t( n * percentile / 100.0 );
+		uint64_t sum = 0;
+		for ( size_t i = 0; i < kNumBuckets; i++ )
+		{
+			sum += getCount( i );
+			if ( sum > rank )
+			{
+				return getBucketUpperBound( i );
+			}
+		}
+		return getBucketUpperBound( kNumBuckets - 1 );
+	}
+
+  private:
+	std::array< std::atomic< uint64_t >, kNumBuckets > mBuckets;
+	std::atomic< uint64_t > mNumSamples;
+	std::atomic< uint64_t > mTotalNs;
+	std::atomic< uint64_t > mMaxNs;
+};
+
+//! Adds the time spent in its scope to a histogram, does nothing unless MNDL_PVAPI_LATENCY_HISTOGRAMS is enabled.
+class ScopedLatency
+{
+  public:
+#if MNDL_PVAPI_LATENCY_HISTOGRAMS
+	explicit ScopedLatency( LatencyHistogram &histogram ) :
+		mHistogram( histogram ), mStart( LatencyHistogram::Clock::now() )
+	{
+	}
+
+	~ScopedLatency()
+	{
+		mHistogram.add( LatencyHistogram::Clock::now() - mStart );
+	}
+
+  private:
+	LatencyHistogram &mHistogram;
+	LatencyHistogram::Clock::time_point mStart;
+#else
+	explicit ScopedLatency( LatencyHistogram & ) {}
+#endif
+};
+
+} } // mndl::pvapi
@@ -0,0 +1,109 @@
+#include "Mono12Packed.h"
+#include "Simd.h"
+#include "SimdLevel.h"
+
+namespace mndl { namespace pvapi {
+
+// Mono12Packed stores two pixels in three bytes b0 b1 b2 as
+// p0 = b0 << 4 | b1 >> 4 and p1 = ( b1 & 0xf ) << 8 | b2. The vector
+// versions gather b0 b1 into the 16-bit lane of p0 and b1 b2 into the lane of
+// p1, then shift the even and mask the odd lanes. They return the number of
+// pixels unpacked, which is always even, and never read past the bytes of
+// numPixels.
+
+#if MNDL_PVAPI_X86_SIMD
+
+MNDL_PVAPI_TARGET( "ssse3" )
+static size_t unpackMono12PackedSsse3( const uint8_t *src, size_t numPixels, uint16_t *dst )
+{
+	const __m128i shuffle = _mm_setr_epi8( 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10 );
+	const __m128i evenMask = _mm_set1_epi32( 0x0000ffff );
+	const __m128i oddMask = _mm_set1_epi32( 0x0fff0000 );
+
+	// 8 pixels are unpacked from 12 bytes, the load reads 16
+	size_t i = 0;
+	for ( ; i + 11 <= numPixels; i += 8, src += 12, dst += 8 )
+	{
+		__m128i v = _mm_shuffle_epi8( _mm_loadu_si128( reinterpret_cast< const __m128i * >( src ) ), shuffle );
+		__m128i even = _mm_and_si128( _mm_srli_epi16( v, 4 ), evenMask );
+		__m128i odd = _mm_and_si128( v, oddMask );
+		_mm_storeu_si128( reinterpret_cast< __m128i * >( dst ), _mm_or_si128( even, odd ) );
+	}
+	return i;
+}
+
+MNDL_PVAPI_TARGET( "avx2" )
+static size_t unpackMono12PackedAvx2( const uint8_t *src, size_t numPixels, uint16_t *dst )
+{
+	// the shuffle works within 128-bit lanes, so each lane gets 12 bytes
+	const __m256i shuffle = _mm256_broadcastsi128_si256(
+			_mm_setr_epi8( 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10 ) );
+	const __m256i evenMask = _mm256_set1_epi32( 0x0000ffff );
+	const __m256i oddMask = _mm256_set1_epi32( 0x0fff0000 );
+
+	// 16 pixels are unpacked from 24 bytes, the loads read 28
+	size_t i = 0;
+	for ( ; i + 19 <= numPixels; i += 16, src += 24, dst += 16 )
+	{
+		__m256i raw = _mm256_inserti128_si256(
+				_mm256_castsi128_si256( _mm_loadu_si128( reinterpret_cast< const __m128i * >( src ) ) ),
+				_mm_loadu_si128( reinterpret_cast< const __m128i * >( src + 12 ) ), 1 );
+		__m256i v = _mm256_shuffle_epi8( raw, shuffle );
+		__m256i even = _mm256_and_si256( _mm256_srli_epi16( v, 4 ), evenMask );
+		__m256i odd = _mm256_and_si256( v, oddMask );
+		_mm256_storeu_si256( reinterpret_cast< __m256i * >( dst ), _mm256_or_si256( even, odd ) );
+	}
+	return i;
+}
+
+#endif
+
+void unpackMono12Packed( const uint8_t *packed, size_t firstPixel, size_t numPixels, uint16_t *dst )
+{
+	const uint8_t *src = packed + firstPixel / 2 * 3;
+
+	// starting at the second pixel of a pair
+	if ( numPixels > 0 && ( firstPixel & 1 ) )
+	{
+		*dst++ = uint16_t( ( src[ 1 ] & 0xf ) << 8 ) | src[ 2 ];
+		src += 3;
+		numPixels--;
+	}
+
+	size_t done = 0;
+#if MNDL_PVAPI_X86_SIMD
+	switch ( getSimdLevel() )
+	{
+		case SimdLevel::AVX2:
+			done = unpackMono12PackedAvx2( src, numPixels, dst );
+			// the SSSE3 version takes the rest
+			MNDL_PVAPI_FALLTHROUGH;
+		case SimdLevel::SSSE3:
+			done += unpackMono12PackedSsse3( src + done / 2 * 3, numPixels - done, dst + done );
+			break;
+
+		default:
+			break;
+	}
+#endif
+	src += done / 2 * 3;
+	dst += done;
+	numPixels -= done;
+
+	for ( ; numPixels >= 2; numPixels -= 2, dst += 2, src += 3 )
+	{
+		uint16_t p0 = src[ 0 ];
+		uint16_t p01 = src[ 1 ];
+		uint16_t p1 = src[ 2 ];
+		dst[ 0 ] = ( p0 << 4 ) | (( p01 & 0xf0 ) >> 4 );
+		dst[ 1 ] = ( ( p01 & 0xf ) << 8 ) | p1;
+	}
+
+	// the last pixel of a frame with an odd number of pixels
+	if ( numPixels == 1 )
+	{
+		dst[ 0 ] = uint16_t( src[ 0 ] << 4 ) | ( src[ 1 ] >> 4 );
+	}
+}
+
+} } // mndl::pvapi
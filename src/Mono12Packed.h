@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mndl { namespace pvapi {
+
+//! Unpacks \a numPixels Mono12Packed pixels starting at pixel \a firstPixel of \a packed to \a dst.
+void unpackMono12Packed( const uint8_t *packed, size_t firstPixel, size_t numPixels, uint16_t *dst );
+
+} } // mndl::pvapi
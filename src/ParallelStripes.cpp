@@ -0,0 +1,116 @@
+#include <algorithm>
+
+#include "ParallelStripes.h"
+
+namespace mndl { namespace pvapi {
+
+ParallelStripes::ParallelStripes( size_t numThreads )
+{
+	for ( size_t i = 0; i < numThreads; i++ )
+	{
+		mThreads.emplace_back( std::make_shared< std::thread >( std::bind( &ParallelStripes::threadedFunc, this ) ) );
+	}
+}
+
+ParallelStripes::~ParallelStripes()
+{
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		mShouldQuit = true;
+	}
+	mWorkCondition.notify_all();
+
+	for ( auto &thread : mThreads )
+	{
+		thread->join();
+	}
+}
+
+void ParallelStripes::run( size_t numStripes, const std::function< void( size_t ) > &fn )
+{
+	std::unique_lock< std::mutex > runLock( mRunMutex, std::try_to_lock );
+	if ( ! runLock.owns_lock() || mThreads.empty() || numStripes < 2 )
+	{
+		for ( size_t i = 0; i < numStripes; i++ )
+		{
+			fn( i );
+		}
+		return;
+	}
+
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		mFn = &fn;
+		mNumStripes = numStripes;
+		mNextStripe = 0;
+		mNumBusy = mThreads.size();
+		mGeneration++;
+	}
+	mWorkCondition.notify_all();
+
+	work();
+
+	std::unique_lock< std::mutex > lock( mMutex );
+	mDoneCondition.wait( lock, [ this ] { return mNumBusy == 0; } );
+	mFn = nullptr;
+}
+
+// static
+void ParallelStripes::forRows( ParallelStripes *stripes, size_t numRows, const std::function< void( size_t, size_t ) > &fn )
+{
+	// a few stripes per thread even out the uneven progress of the threads
+	const size_t numStripes = stripes ? std::min( numRows, stripes->getNumThreads() * 4 ) : 1;
+	if ( numStripes <= 1 )
+	{
+		fn( 0, numRows );
+		return;
+	}
+
+	const size_t rowsPerStripe = ( numRows + numStripes - 1 ) / numStripes;
+	stripes->run( numStripes,
+			[ & ]( size_t stripe )
+			{
+				size_t begin = stripe * rowsPerStripe;
+				size_t end = std::min( begin + rowsPerStripe, numRows );
+				if ( begin < end )
+				{
+					fn( begin, end );
+				}
+			} );
+}
+
+void ParallelStripes::threadedFunc()
+{
+	uint64_t generation = 0;
+	while ( true )
+	{
+		{
+			std::unique_lock< std::mutex > lock( mMutex );
+			mWorkCondition.wait( lock, [ & ] { return mShouldQuit || mGeneration != generation; } );
+			if ( mShouldQuit )
+			{
+				return;
+			}
+			generation = mGeneration;
+		}
+
+		work();
+
+		std::lock_guard< std::mutex > lock( mMutex );
+		if ( --mNumBusy == 0 )
+		{
+			mDoneCondition.notify_one();
+		}
+	}
+}
+
+void ParallelStripes::work()
+{
+	size_t stripe;
+	while ( ( stripe = mNextStripe.fetch_add( 1 ) ) < mNumStripes )
+	{
+		( *mFn )( stripe );
+	}
+}
+
+} } // mndl::pvapi
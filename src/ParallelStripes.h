@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mndl { namespace pvapi {
+
+typedef std::shared_ptr< class ParallelStripes > ParallelStripesRef;
+
+//! Persistent worker threads splitting the rows of a frame into stripes.
+//! The calling thread works on the stripes too. If the workers are busy with
+//! another frame, run() processes all stripes on the calling thread instead
+//! of waiting.
+class ParallelStripes
+{
+  public:
+	static ParallelStripesRef create( size_t numThreads )
+	{ return ParallelStripesRef( new ParallelStripes( numThreads ) ); }
+
+	~ParallelStripes();
+
+	//! Returns the number of threads working on the stripes including the caller.
+	size_t getNumThreads() const { return mThreads.size() + 1; }
+
+	//! Calls \a fn( stripe ) for every stripe in [0, numStripes), returns when all of them are done.
+	void run( size_t numStripes, const std::function< void( size_t ) > &fn );
+
+	//! Calls \a fn( beginRow, endRow ) on stripes of \a numRows, \a stripes may be null.
+	static void forRows( ParallelStripes *stripes, size_t numRows, const std::function< void( size_t, size_t ) > &fn );
+
+  protected:
+	explicit ParallelStripes( size_t numThreads );
+
+	void threadedFunc();
+	void work();
+
+	std::vector< std::shared_ptr< std::thread > > mThreads;
+
+	//! held by the thread running the stripes
+	std::mutex mRunMutex;
+
+	std::mutex mMutex;
+	std::condition_variable mWorkCondition;
+	std::condition_variable mDoneCondition;
+	uint64_t mGeneration = 0;
+	bool mShouldQuit = false;
+
+	const std::function< void( size_t ) > *mFn = nullptr;
+	size_t mNumStripes = 0;
+	std::atomic< size_t > mNextStripe { 0 };
+	size_t mNumBusy = 0;
+};
+
+} } // mndl::pvapi
@@ -0,0 +1,816 @@
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+
+#include "PixelConversion.h"
+#include "Simd.h"
+
+namespace mndl { namespace pvapi {
+
+//! Linear mapping of the levels [ min, min + range ] to [ 0, 255 ] as ( ( v - min ) * scale ) >> 16.
+struct LevelWindow
+{
+	LevelWindow( uint16_t minLevel, uint16_t maxLevel )
+	{
+		min = std::min( minLevel, maxLevel );
+		range = std::max( uint16_t( std::max( minLevel, maxLevel ) - min ), uint16_t( 1 ) );
+		// rounded up so that the top of the window maps to 255
+		scale = ( 255u * 65536u + range - 1 ) / range;
+	}
+
+	//! Returns whether the scale needs more than 16 bits, which the vector versions do not support.
+	bool isNarrow() const { return scale > 0xffff; }
+
+	uint8_t map( uint16_t v ) const
+	{
+		uint32_t d = v > min ? std::min< uint32_t >( v - min, range ) : 0;
+		return uint8_t( std::min< uint32_t >( ( d * scale ) >> 16, 255 ) );
+	}
+
+	uint16_t min;
+	uint16_t range;
+	uint32_t scale;
+};
+
+#if MNDL_PVAPI_X86_SIMD
+
+MNDL_PVAPI_TARGET( "sse2" )
+static size_t convertRow16uTo8uSse2( const uint16_t *src, uint8_t *dst, size_t n, const LevelWindow &window )
+{
+	const __m128i min = _mm_set1_epi16( int16_t( window.min ) );
+	const __m128i range = _mm_set1_epi16( int16_t( window.range ) );
+	const __m128i scale = _mm_set1_epi16( int16_t( window.scale ) );
+
+	size_t i = 0;
+	for ( ; i + 16 <= n; i += 16 )
+	{
+		__m128i a = _mm_subs_epu16( _mm_loadu_si128( reinterpret_cast< const __m128i * >( src + i ) ), min );
+		__m128i b = _mm_subs_epu16( _mm_loadu_si128( reinterpret_cast< const __m128i * >( src + i + 8 ) ), min );
+		// min( v, range ) without SSE4.1
+		a = _mm_sub_epi16( a, _mm_subs_epu16( a, range ) );
+		b = _mm_sub_epi16( b, _mm_subs_epu16( b, range ) );
+		a = _mm_mulhi_epu16( a, scale );
+		b = _mm_mulhi_epu16( b, scale );
+		_mm_storeu_si128( reinterpret_cast< __m128i * >( dst + i ), _mm_packus_epi16( a, b ) );
+	}
+	return i;
+}
+
+MNDL_PVAPI_TARGET( "avx2" )
+static size_t convertRow16uTo8uAvx2( const uint16_t *src, uint8_t *dst, size_t n, const LevelWindow &window )
+{
+	const __m256i min = _mm256_set1_epi16( int16_t( window.min ) );
+	const __m256i range = _mm256_set1_epi16( int16_t( window.range ) );
+	const __m256i scale = _mm256_set1_epi16( int16_t( window.scale ) );
+
+	size_t i = 0;
+	for ( ; i + 32 <= n; i += 32 )
+	{
+		__m256i a = _mm256_subs_epu16( _mm256_loadu_si256( reinterpret_cast< const __m256i * >( src + i ) ), min );
+		__m256i b = _mm256_subs_epu16( _mm256_loadu_si256( reinterpret_cast< const __m256i * >( src + i + 16 ) ), min );
+		a = _mm256_min_epu16( a, range );
+		b = _mm256_min_epu16( b, range );
+		a = _mm256_mulhi_epu16( a, scale );
+		b = _mm256_mulhi_epu16( b, scale );
+		// packing works within 128-bit lanes
+		__m256i packed = _mm256_permute4x64_epi64( _mm256_packus_epi16( a, b ), 0xd8 );
+		_mm256_storeu_si256( reinterpret_cast< __m256i * >( dst + i ), packed );
+	}
+	return i;
+}
+
+MNDL_PVAPI_TARGET( "ssse3" )
+static size_t expandGrayToRgbSsse3( const uint8_t *src, uint8_t *dst, size_t n )
+{
+	const __m128i shuffle0 = _mm_setr_epi8( 0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5 );
+	const __m128i shuffle1 = _mm_setr_epi8( 5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10 );
+	const __m128i shuffle2 = _mm_setr_epi8( 10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15 );
+
+	size_t i = 0;
+	for ( ; i + 16 <= n; i += 16, dst += 48 )
+	{
+		__m128i gray = _mm_loadu_si128( reinterpret_cast< const __m128i * >( src + i ) );
+		_mm_storeu_si128( reinterpret_cast< __m128i * >( dst ), _mm_shuffle_epi8( gray, shuffle0 ) );
+		_mm_storeu_si128( reinterpret_cast< __m128i * >( dst + 16 ), _mm_shuffle_epi8( gray, shuffle1 ) );
+		_mm_storeu_si128( reinterpret_cast< __m128i * >( dst + 32 ), _mm_shuffle_epi8( gray, shuffle2 ) );
+	}
+	return i;
+}
+
+#endif
+
+static void convertRow16uTo8u( const uint16_t *src, uint8_t *dst, size_t n, const LevelWindow &window )
+{
+	size_t done = 0;
+#if MNDL_PVAPI_X86_SIMD
+	if ( ! window.isNarrow() )
+	{
+		switch ( getSimdLevel() )
+		{
+			case SimdLevel::AVX2:
+				done = convertRow16uTo8uAvx2( src, dst, n, window );
+				MNDL_PVAPI_FALLTHROUGH;
+			case SimdLevel::SSSE3:
+			case SimdLevel::SSE2:
+				done += convertRow16uTo8uSse2( src + done, dst + done, n - done, window );
+				break;
+
+			default:
+				break;
+		}
+	}
+#endif
+	for ( size_t i = done; i < n; i++ )
+	{
+		dst[ i ] = window.map( src[ i ] );
+	}
+}
+
+//! Maps rows of levels with the window or the table of a LevelMapping.
+class RowMapper
+{
+  public:
+	explicit RowMapper( const LevelMapping &mapping ) :
+		mWindow( mapping.mMinLevel, mapping.mMaxLevel ), mLut( mapping.mLut.get() )
+	{
+	}
+
+	void operator()( const uint16_t *src, uint8_t *dst, size_t n ) const
+	{
+		if ( mLut )
+		{
+			for ( size_t i = 0; i < n; i++ )
+			{
+				dst[ i ] = mLut->map( src[ i ] );
+			}
+		}
+		else
+		{
+			convertRow16uTo8u( src, dst, n, mWindow );
+		}
+	}
+
+	uint8_t map( uint16_t v ) const { return mLut ? mLut->map( v ) : mWindow.map( v ); }
+
+  private:
+	LevelWindow mWindow;
+	const ToneLut *mLut;
+};
+
+//! Copies gray levels to the color channels of a row of \a pixelInc bytes per pixel, alpha is set to 255.
+static void expandGrayRow( const uint8_t *src, uint8_t *dst, size_t n, uint8_t pixelInc, int alphaOffset )
+{
+	size_t done = 0;
+#if MNDL_PVAPI_X86_SIMD
+	if ( pixelInc == 3 && getSimdLevel() >= SimdLevel::SSSE3 )
+	{
+		done = expandGrayToRgbSsse3( src, dst, n );
+	}
+#endif
+	for ( size_t i = done; i < n; i++ )
+	{
+		uint8_t *pixel = dst + i * pixelInc;
+		for ( uint8_t c = 0; c < pixelInc; c++ )
+		{
+			pixel[ c ] = src[ i ];
+		}
+	}
+
+	if ( alphaOffset >= 0 )
+	{
+		for ( size_t i = 0; i < n; i++ )
+		{
+			dst[ i * pixelInc + alphaOffset ] = 255;
+		}
+	}
+}
+
+void convert16uTo8u( const ci::Channel16u &src, ci::Channel8u *dst, const LevelMapping &mapping, ParallelStripes *stripes )
+{
+	const RowMapper mapRow( mapping );
+	const size_t width = dst->getWidth();
+	ParallelStripes::forRows( stripes, dst->getHeight(),
+			[ & ]( size_t beginRow, size_t endRow )
+			{
+				for ( size_t y = beginRow; y < endRow; y++ )
+				{
+					const uint16_t *srcRow = reinterpret_cast< const uint16_t * >( reinterpret_cast< const uint8_t * >( src.getData() ) + y * src.getRowBytes() );
+					uint8_t *dstRow = dst->getData() + y * dst->getRowBytes();
+					mapRow( srcRow, dstRow, width );
+				}
+			} );
+}
+
+void convert16uTo8u( const ci::Channel16u &src, ci::Surface8u *dst, const LevelMapping &mapping, ParallelStripes *stripes )
+{
+	const RowMapper mapRow( mapping );
+	const size_t width = dst->getWidth();
+	const uint8_t pixelInc = dst->getPixelInc();
+	const int alphaOffset = dst->hasAlpha() ? dst->getAlphaOffset() : -1;
+	ParallelStripes::forRows( stripes, dst->getHeight(),
+			[ & ]( size_t beginRow, size_t endRow )
+			{
+				// converted in chunks through the stack to stay in the cache
+				const size_t kChunk = 1024;
+				uint8_t gray[ kChunk ];
+				for ( size_t y = beginRow; y < endRow; y++ )
+				{
+					const uint16_t *srcRow = reinterpret_cast< const uint16_t * >( reinterpret_cast< const uint8_t * >( src.getData() ) + y * src.getRowBytes() );
+					uint8_t *dstRow = dst->getData() + y * dst->getRowBytes();
+					for ( size_t x = 0; x < width; x += kChunk )
+					{
+						size_t n = std::min( kChunk, width - x );
+						mapRow( srcRow + x, gray, n );
+						expandGrayRow( gray, dstRow + x * pixelInc, n, pixelInc, alphaOffset );
+					}
+				}
+			} );
+}
+
+void convert16uTo8u( const ci::Surface16u &src, ci::Surface8u *dst, const LevelMapping &mapping, ParallelStripes *stripes )
+{
+	const RowMapper mapRow( mapping );
+	const size_t width = dst->getWidth();
+	const bool sameOrder = src.getChannelOrder() == dst->getChannelOrder();
+	const uint8_t srcPixelInc = src.getPixelInc();
+	const uint8_t dstPixelInc = dst->getPixelInc();
+	const uint8_t srcOffsets[ 3 ] = { src.getRedOffset(), src.getGreenOffset(), src.getBlueOffset() };
+	const uint8_t dstOffsets[ 3 ] = { dst->getRedOffset(), dst->getGreenOffset(), dst->getBlueOffset() };
+	const int alphaOffset = dst->hasAlpha() ? dst->getAlphaOffset() : -1;
+
+	ParallelStripes::forRows( stripes, dst->getHeight(),
+			[ & ]( size_t beginRow, size_t endRow )
+			{
+				for ( size_t y = beginRow; y < endRow; y++ )
+				{
+					const uint16_t *srcRow = reinterpret_cast< const uint16_t * >( reinterpret_cast< const uint8_t * >( src.getData() ) + y * src.getRowBytes() );
+					uint8_t *dstRow = dst->getData() + y * dst->getRowBytes();
+					if ( sameOrder )
+					{
+						// the rows are converted as a whole, alpha is mapped like the colors
+						mapRow( srcRow, dstRow, width * dstPixelInc );
+						continue;
+					}
+
+					for ( size_t x = 0; x < width; x++ )
+					{
+						for ( size_t c = 0; c < 3; c++ )
+						{
+							dstRow[ x * dstPixelInc + dstOffsets[ c ] ] = mapRow.map( srcRow[ x * srcPixelInc + srcOffsets[ c ] ] );
+						}
+						if ( alphaOffset >= 0 )
+						{
+							dstRow[ x * dstPixelInc + alphaOffset ] = 255;
+						}
+					}
+				}
+			} );
+}
+
+//! Weighs the color channels of a row of \a pixelInc values per pixel to gray levels like ci::ip::grayscale().
+template< typename T >
+static void grayscaleRow( const T *src, uint8_t pixelInc, const uint8_t *offsets, T *dst, size_t n )
+{
+	for ( size_t i = 0; i < n; i++ )
+	{
+		const T *pixel = src + i * pixelInc;
+		dst[ i ] = T( ( uint32_t( pixel[ offsets[ 0 ] ] ) * 54 + uint32_t( pixel[ offsets[ 1 ] ] ) * 183 + uint32_t( pixel[ offsets[ 2 ] ] ) * 19 ) >> 8 );
+	}
+}
+
+void convert16uTo8u( const ci::Surface16u &src, ci::Channel8u *dst, const LevelMapping &mapping, ParallelStripes *stripes )
+{
+	const RowMapper mapRow( mapping );
+	const size_t width = dst->getWidth();
+	const uint8_t pixelInc = src.getPixelInc();
+	const uint8_t offsets[ 3 ] = { src.getRedOffset(), src.getGreenOffset(), src.getBlueOffset() };
+	ParallelStripes::forRows( stripes, dst->getHeight(),
+			[ & ]( size_t beginRow, size_t endRow )
+			{
+				// converted in chunks through the stack to stay in the cache
+				const size_t kChunk = 1024;
+				uint16_t gray[ kChunk ];
+				for ( size_t y = beginRow; y < endRow; y++ )
+				{
+					const uint16_t *srcRow = reinterpret_cast< const uint16_t * >( reinterpret_cast< const uint8_t * >( src.getData() ) + y * src.getRowBytes() );
+					uint8_t *dstRow = dst->getData() + y * dst->getRowBytes();
+					for ( size_t x = 0; x < width; x += kChunk )
+					{
+						size_t n = std::min( kChunk, width - x );
+						grayscaleRow( srcRow + x * pixelInc, pixelInc, offsets, gray, n );
+						mapRow( gray, dstRow + x, n );
+					}
+				}
+			} );
+}
+
+void convert8uTo16u( const ci::Surface8u &src, ci::Channel16u *dst, ParallelStripes *stripes )
+{
+	const size_t width = dst->getWidth();
+	const uint8_t pixelInc = src.getPixelInc();
+	const uint8_t offsets[ 3 ] = { src.getRedOffset(), src.getGreenOffset(), src.getBlueOffset() };
+	ParallelStripes::forRows( stripes, dst->getHeight(),
+			[ & ]( size_t beginRow, size_t endRow )
+			{
+				const size_t kChunk = 1024;
+				uint8_t gray[ kChunk ];
+				for ( size_t y = beginRow; y < endRow; y++ )
+				{
+					const uint8_t *srcRow = src.getData() + y * src.getRowBytes();
+					uint16_t *dstRow = reinterpret_cast< uint16_t * >( reinterpret_cast< uint8_t * >( dst->getData() ) + y * dst->getRowBytes() );
+					for ( size_t x = 0; x < width; x += kChunk )
+					{
+						size_t n = std::min( kChunk, width - x );
+						grayscaleRow( srcRow + x * pixelInc, pixelInc, offsets, gray, n );
+						for ( size_t i = 0; i < n; i++ )
+						{
+							dstRow[ x + i ] = uint16_t( gray[ i ] * 257 );
+						}
+					}
+				}
+			} );
+}
+
+void convert8uTo16u( const ci::Channel8u &src, ci::Channel16u *dst, ParallelStripes *stripes )
+{
+	const size_t width = dst->getWidth();
+	ParallelStripes::forRows( stripes, dst->getHeight(),
+			[ & ]( size_t beginRow, size_t endRow )
+			{
+				for ( size_t y = beginRow; y < endRow; y++ )
+				{
+					const uint8_t *srcRow = src.getData() + y * src.getRowBytes();
+					uint16_t *dstRow = reinterpret_cast< uint16_t * >( reinterpret_cast< uint8_t * >( dst->getData() ) + y * dst->getRowBytes() );
+					for ( size_t x = 0; x < width; x++ )
+					{
+						dstRow[ x ] = uint16_t( srcRow[ x ] * 257 );
+					}
+				}
+			} );
+}
+
+void convert8uToSurface( const ci::Channel8u &src, ci::Surface8u *dst, ParallelStripes *stripes )
+{
+	const size_t width = dst->getWidth();
+	const uint8_t pixelInc = dst->getPixelInc();
+	const int alphaOffset = dst->hasAlpha() ? dst->getAlphaOffset() : -1;
+	ParallelStripes::forRows( stripes, dst->getHeight(),
+			[ & ]( size_t beginRow, size_t endRow )
+			{
+				for ( size_t y = beginRow; y < endRow; y++ )
+				{
+					expandGrayRow( src.getData() + y * src.getRowBytes(), dst->getData() + y * dst->getRowBytes(),
+							width, pixelInc, alphaOffset );
+				}
+			} );
+}
+
+void unpackMono12Packed( const uint8_t *packed, ci::Channel16u *dst, ParallelStripes *stripes )
+{
+	const size_t width = dst->getWidth();
+	const ptrdiff_t rowBytes = dst->getRowBytes();
+	uint8_t *dstData = reinterpret_cast< uint8_t * >( dst->getData() );
+
+	ParallelStripes::forRows( stripes, dst->getHeight(),
+			[ & ]( size_t beginRow, size_t endRow )
+			{
+				if ( rowBytes == ptrdiff_t( width * sizeof( uint16_t ) ) )
+				{
+					unpackMono12Packed( packed, beginRow * width, ( endRow - beginRow ) * width,
+							reinterpret_cast< uint16_t * >( dstData + beginRow * rowBytes ) );
+				}
+				else
+				{
+					for ( size_t y = beginRow; y < endRow; y++ )
+					{
+						unpackMono12Packed( packed, y * width, width,
+								reinterpret_cast< uint16_t * >( dstData + y * rowBytes ) );
+					}
+				}
+			} );
+}
+
+void unpackMono12Packed( const uint8_t *packed, ci::Channel16u *dst, ci::Channel8u *dst8u, const LevelMapping &mapping,
+		const FlatFieldCorrection *correction, FrameStatistics *stats, ParallelStripes *stripes )
+{
+	const RowMapper mapRow( mapping );
+	const size_t width = dst->getWidth();
+	std::mutex statsMutex;
+	ParallelStripes::forRows( stripes, dst->getHeight(),
+			[ & ]( size_t beginRow, size_t endRow )
+			{
+				StatisticsAccumulator accumulator( stats ? stats->mBitDepth : 16 );
+				for ( size_t y = beginRow; y < endRow; y++ )
+				{
+					uint16_t *row = reinterpret_cast< uint16_t * >( reinterpret_cast< uint8_t * >( dst->getData() ) + y * dst->getRowBytes() );
+					unpackMono12Packed( packed, y * width, width, row );
+					if ( correction )
+					{
+						correction->correctRow( row, y, width );
+					}
+					if ( stats )
+					{
+						accumulator.addRow( row, width );
+					}
+					if ( dst8u )
+					{
+						mapRow( row, dst8u->getData() + y * dst8u->getRowBytes(), width );
+					}
+				}
+
+				if ( stats )
+				{
+					std::lock_guard< std::mutex > lock( statsMutex );
+					accumulator.mergeInto( stats );
+				}
+			} );
+}
+
+// The packed YUV formats store groups of pixels sharing U and V in the IIDC
+// byte order, Yuv411 as U Y Y V Y Y, Yuv422 as U Y V Y and Yuv444 as U Y V.
+// They are converted with the JFIF full range equations R = Y + 1.402 V,
+// G = Y - 0.344136 U - 0.714136 V and B = Y + 1.772 U, with U and V centered
+// on 0. The fractions are in Q15 and rounded like _mm_mulhrs_epi16, so the
+// vector version gives the same result.
+
+//! Byte offsets of the pixels of a group in a packed YUV format.
+struct YuvLayout
+{
+	size_t groupPixels;
+	size_t groupBytes;
+	uint8_t y[ 4 ];
+	uint8_t u;
+	uint8_t v;
+};
+
+static const YuvLayout & getYuvLayout( YuvFormat format )
+{
+	static const YuvLayout kLayouts[ 3 ] = {
+		{ 4, 6, { 1, 2, 4, 5 }, 0, 3 },
+		{ 2, 4, { 1, 3, 0, 0 }, 0, 2 },
+		{ 1, 3, { 1, 0, 0, 0 }, 0, 2 }
+	};
+	return kLayouts[ size_t( format ) ];
+}
+
+//! 1.402 - 1, 0.344136, 0.714136 and 1.772 - 1 in Q15
+static const int16_t kVToR = 13173;
+static const int16_t kUToG = 11277;
+static const int16_t kVToG = 23401;
+static const int16_t kUToB = 25297;
+
+static inline int32_t mulQ15( int32_t a, int32_t b )
+{
+	return ( a * b + 0x4000 ) >> 15;
+}
+
+static inline uint8_t clamp8u( int32_t v )
+{
+	return uint8_t( std::min( std::max( v, 0 ), 255 ) );
+}
+
+#if MNDL_PVAPI_X86_SIMD
+
+//! Byte shuffles gathering the Y, U and V of 16 pixels from consecutive 16 byte loads of a packed YUV format.
+struct YuvShuffles
+{
+	explicit YuvShuffles( const YuvLayout &layout )
+	{
+		numLoads = ( 16 * layout.groupBytes / layout.groupPixels + 15 ) / 16;
+		for ( size_t load = 0; load < 3; load++ )
+		{
+			for ( size_t plane = 0; plane < 3; plane++ )
+			{
+				for ( size_t i = 0; i < 16; i++ )
+				{
+					size_t offset = plane == 0 ? layout.y[ i % layout.groupPixels ] : ( plane == 1 ? layout.u : layout.v );
+					size_t index = i / layout.groupPixels * layout.groupBytes + offset;
+					mShuffles[ load ][ plane ][ i ] = int8_t( index / 16 == load ? index % 16 : 0x80 );
+				}
+			}
+		}
+	}
+
+	size_t numLoads;
+	alignas( 16 ) int8_t mShuffles[ 3 ][ 3 ][ 16 ];
+};
+
+MNDL_PVAPI_TARGET( "ssse3" )
+static size_t convertYuvRowSsse3( const uint8_t *src, size_t srcBytes, uint8_t *dst, size_t width, YuvFormat format, bool redFirst )
+{
+	static const YuvShuffles sGathers[ 3 ] = {
+		YuvShuffles( getYuvLayout( YuvFormat::YUV411 ) ),
+		YuvShuffles( getYuvLayout( YuvFormat::YUV422 ) ),
+		YuvShuffles( getYuvLayout( YuvFormat::YUV444 ) )
+	};
+	static const InterleaveShuffles< uint8_t > sInterleave;
+
+	const YuvLayout &layout = getYuvLayout( format );
+	const YuvShuffles &gather = sGathers[ size_t( format ) ];
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i center = _mm_set1_epi16( 128 );
+	const __m128i vToR = _mm_set1_epi16( kVToR );
+	const __m128i uToG = _mm_set1_epi16( kUToG );
+	const __m128i vToG = _mm_set1_epi16( kVToG );
+	const __m128i uToB = _mm_set1_epi16( kUToB );
+
+	size_t x = 0;
+	for ( ; x + 16 <= width && x / layout.groupPixels * layout.groupBytes + gather.numLoads * 16 <= srcBytes; x += 16 )
+	{
+		const uint8_t *group = src + x / layout.groupPixels * layout.groupBytes;
+		__m128i planes[ 3 ] = { zero, zero, zero };
+		for ( size_t load = 0; load < gather.numLoads; load++ )
+		{
+			__m128i bytes = _mm_loadu_si128( reinterpret_cast< const __m128i * >( group + load * 16 ) );
+			for ( size_t plane = 0; plane < 3; plane++ )
+			{
+				__m128i shuffle = _mm_load_si128( reinterpret_cast< const __m128i * >( gather.mShuffles[ load ][ plane ] ) );
+				planes[ plane ] = _mm_or_si128( planes[ plane ], _mm_shuffle_epi8( bytes, shuffle ) );
+			}
+		}
+
+		__m128i rgb[ 3 ][ 2 ];
+		for ( size_t half = 0; half < 2; half++ )
+		{
+			__m128i y = half ? _mm_unpackhi_epi8( planes[ 0 ], zero ) : _mm_unpacklo_epi8( planes[ 0 ], zero );
+			__m128i u = _mm_sub_epi16( half ? _mm_unpackhi_epi8( planes[ 1 ], zero ) : _mm_unpacklo_epi8( planes[ 1 ], zero ), center );
+			__m128i v = _mm_sub_epi16( half ? _mm_unpackhi_epi8( planes[ 2 ], zero ) : _mm_unpacklo_epi8( planes[ 2 ], zero ), center );
+			rgb[ 0 ][ half ] = _mm_add_epi16( _mm_add_epi16( y, v ), _mm_mulhrs_epi16( v, vToR ) );
+			rgb[ 1 ][ half ] = _mm_sub_epi16( _mm_sub_epi16( y, _mm_mulhrs_epi16( u, uToG ) ), _mm_mulhrs_epi16( v, vToG ) );
+			rgb[ 2 ][ half ] = _mm_add_epi16( _mm_add_epi16( y, u ), _mm_mulhrs_epi16( u, uToB ) );
+		}
+		__m128i red = _mm_packus_epi16( rgb[ 0 ][ 0 ], rgb[ 0 ][ 1 ] );
+		__m128i green = _mm_packus_epi16( rgb[ 1 ][ 0 ], rgb[ 1 ][ 1 ] );
+		__m128i blue = _mm_packus_epi16( rgb[ 2 ][ 0 ], rgb[ 2 ][ 1 ] );
+		__m128i first = redFirst ? red : blue;
+		__m128i last = redFirst ? blue : red;
+
+		for ( size_t out = 0; out < 3; out++ )
+		{
+			__m128i pixels = _mm_or_si128( _mm_or_si128(
+					_mm_shuffle_epi8( first, _mm_load_si128( reinterpret_cast< const __m128i * >( sInterleave.mShuffles[ out ][ 0 ] ) ) ),
+					_mm_shuffle_epi8( green, _mm_load_si128( reinterpret_cast< const __m128i * >( sInterleave.mShuffles[ out ][ 1 ] ) ) ) ),
+					_mm_shuffle_epi8( last, _mm_load_si128( reinterpret_cast< const __m128i * >( sInterleave.mShuffles[ out ][ 2 ] ) ) ) );
+			_mm_storeu_si128( reinterpret_cast< __m128i * >( dst + x * 3 + out * 16 ), pixels );
+		}
+	}
+	return x;
+}
+
+#endif
+
+//! Converts a row of packed YUV of \a srcBytes bytes to \a width pixels of \a pixelInc bytes.
+static void convertYuvRow( const uint8_t *src, size_t srcBytes, uint8_t *dst, size_t width, YuvFormat format,
+		uint8_t pixelInc, uint8_t redOffset, uint8_t greenOffset, uint8_t blueOffset )
+{
+	const YuvLayout &layout = getYuvLayout( format );
+
+	size_t done = 0;
+#if MNDL_PVAPI_X86_SIMD
+	if ( pixelInc == 3 && greenOffset == 1 && getSimdLevel() >= SimdLevel::SSSE3 )
+	{
+		done = convertYuvRowSsse3( src, srcBytes, dst, width, format, redOffset == 0 );
+	}
+#endif
+	for ( size_t x = done; x < width; x++ )
+	{
+		const uint8_t *group = src + x / layout.groupPixels * layout.groupBytes;
+		int32_t y = group[ layout.y[ x % layout.groupPixels ] ];
+		int32_t u = int32_t( group[ layout.u ] ) - 128;
+		int32_t v = int32_t( group[ layout.v ] ) - 128;
+
+		uint8_t *pixel = dst + x * pixelInc;
+		pixel[ redOffset ] = clamp8u( y + v + mulQ15( v, kVToR ) );
+		pixel[ greenOffset ] = clamp8u( y - mulQ15( u, kUToG ) - mulQ15( v, kVToG ) );
+		pixel[ blueOffset ] = clamp8u( y + u + mulQ15( u, kUToB ) );
+	}
+}
+
+void convertYuvToRgb( const uint8_t *src, YuvFormat format, ci::Surface8u *dst, ParallelStripes *stripes )
+{
+	const YuvLayout &layout = getYuvLayout( format );
+	const size_t width = dst->getWidth();
+	const size_t srcRowBytes = width * layout.groupBytes / layout.groupPixels;
+	const uint8_t pixelInc = dst->getPixelInc();
+	const uint8_t redOffset = dst->getRedOffset();
+	const uint8_t greenOffset = dst->getGreenOffset();
+	const uint8_t blueOffset = dst->getBlueOffset();
+	const int alphaOffset = dst->hasAlpha() ? dst->getAlphaOffset() : -1;
+
+	ParallelStripes::forRows( stripes, dst->getHeight(),
+			[ & ]( size_t beginRow, size_t endRow )
+			{
+				for ( size_t y = beginRow; y < endRow; y++ )
+				{
+					uint8_t *dstRow = dst->getData() + y * dst->getRowBytes();
+					convertYuvRow( src + y * srcRowBytes, srcRowBytes, dstRow, width, format,
+							pixelInc, redOffset, greenOffset, blueOffset );
+					if ( alphaOffset >= 0 )
+					{
+						for ( size_t x = 0; x < width; x++ )
+						{
+							dstRow[ x * pixelInc + alphaOffset ] = 255;
+						}
+					}
+				}
+			} );
+}
+
+// Downscaling averages blocks of factor x factor pixels. The rows of a block
+// are added to 32-bit column sums, 16 or 8 samples at a time with SSE2, which
+// is where all the source pixels are read. The columns of each block are then
+// added up and rounded, the averages of a chunk of a row of blocks at a time
+// are handed to the output.
+
+#if MNDL_PVAPI_X86_SIMD
+
+MNDL_PVAPI_TARGET( "sse2" )
+static size_t addColumnSumsSse2( const uint8_t *src, uint32_t *sums, size_t n )
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for ( ; i + 16 <= n; i += 16 )
+	{
+		__m128i v = _mm_loadu_si128( reinterpret_cast< const __m128i * >( src + i ) );
+		__m128i lo = _mm_unpacklo_epi8( v, zero );
+		__m128i hi = _mm_unpackhi_epi8( v, zero );
+		__m128i *s = reinterpret_cast< __m128i * >( sums + i );
+		_mm_storeu_si128( s, _mm_add_epi32( _mm_loadu_si128( s ), _mm_unpacklo_epi16( lo, zero ) ) );
+		_mm_storeu_si128( s + 1, _mm_add_epi32( _mm_loadu_si128( s + 1 ), _mm_unpackhi_epi16( lo, zero ) ) );
+		_mm_storeu_si128( s + 2, _mm_add_epi32( _mm_loadu_si128( s + 2 ), _mm_unpacklo_epi16( hi, zero ) ) );
+		_mm_storeu_si128( s + 3, _mm_add_epi32( _mm_loadu_si128( s + 3 ), _mm_unpackhi_epi16( hi, zero ) ) );
+	}
+	return i;
+}
+
+MNDL_PVAPI_TARGET( "sse2" )
+static size_t addColumnSumsSse2( const uint16_t *src, uint32_t *sums, size_t n )
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for ( ; i + 8 <= n; i += 8 )
+	{
+		__m128i v = _mm_loadu_si128( reinterpret_cast< const __m128i * >( src + i ) );
+		__m128i *s = reinterpret_cast< __m128i * >( sums + i );
+		_mm_storeu_si128( s, _mm_add_epi32( _mm_loadu_si128( s ), _mm_unpacklo_epi16( v, zero ) ) );
+		_mm_storeu_si128( s + 1, _mm_add_epi32( _mm_loadu_si128( s + 1 ), _mm_unpackhi_epi16( v, zero ) ) );
+	}
+	return i;
+}
+
+#endif
+
+template< typename T >
+static void addColumnSums( const T *src, uint32_t *sums, size_t n )
+{
+	size_t done = 0;
+#if MNDL_PVAPI_X86_SIMD
+	if ( getSimdLevel() >= SimdLevel::SSE2 )
+	{
+		done = addColumnSumsSse2( src, sums, n );
+	}
+#endif
+	for ( size_t i = done; i < n; i++ )
+	{
+		sums[ i ] += src[ i ];
+	}
+}
+
+//! number of blocks averaged at a time
+static const size_t kBlockChunk = 256;
+
+//! Output of the averages of \a n blocks starting at block \a x of the row of blocks \a y, \a numChannels interleaved values per block.
+typedef std::function< void( size_t y, size_t x, size_t n, const uint16_t *averages ) > EmitBlocksFn;
+
+//! Averages the blocks of the \a numChannels samples at \a offsets of pixels \a pixelInc apart.
+template< typename T >
+static void averageBlocks( const T *data, ptrdiff_t rowBytes, uint8_t pixelInc, const uint8_t *offsets, size_t numChannels,
+		size_t factor, size_t dstWidth, size_t dstHeight, ParallelStripes *stripes, const EmitBlocksFn &emit )
+{
+	uint32_t shift = 0;
+	while ( ( size_t( 1 ) << shift ) < factor * factor )
+	{
+		shift++;
+	}
+	const uint32_t half = ( 1u << shift ) >> 1;
+
+	ParallelStripes::forRows( stripes, dstHeight,
+			[ & ]( size_t beginRow, size_t endRow )
+			{
+				// room for factor 4 blocks of 4 samples per pixel
+				uint32_t sums[ kBlockChunk * 4 * 4 ];
+				uint16_t averages[ kBlockChunk * 3 ];
+				for ( size_t y = beginRow; y < endRow; y++ )
+				{
+					for ( size_t x = 0; x < dstWidth; x += kBlockChunk )
+					{
+						const size_t n = std::min( kBlockChunk, dstWidth - x );
+						const size_t numSamples = n * factor * pixelInc;
+						std::fill( sums, sums + numSamples, 0 );
+						for ( size_t r = 0; r < factor; r++ )
+						{
+							const T *row = reinterpret_cast< const T * >( reinterpret_cast< const uint8_t * >( data ) + ( y * factor + r ) * rowBytes );
+							addColumnSums( row + x * factor * pixelInc, sums, numSamples );
+						}
+
+						for ( size_t b = 0; b < n; b++ )
+						{
+							const uint32_t *block = sums + b * factor * pixelInc;
+							for ( size_t c = 0; c < numChannels; c++ )
+							{
+								uint32_t sum = 0;
+								for ( size_t k = 0; k < factor; k++ )
+								{
+									sum += block[ k * pixelInc + offsets[ c ] ];
+								}
+								averages[ b * numChannels + c ] = uint16_t( ( sum + half ) >> shift );
+							}
+						}
+						emit( y, x, n, averages );
+					}
+				}
+			} );
+}
+
+//! Copies \a n averaged gray levels to the color channels of \a dst starting at pixel \a x of row \a y.
+static void emitGrayBlocks( const uint8_t *gray, ci::Surface8u *dst, size_t y, size_t x, size_t n )
+{
+	const uint8_t pixelInc = dst->getPixelInc();
+	expandGrayRow( gray, dst->getData() + y * dst->getRowBytes() + x * pixelInc, n, pixelInc,
+			dst->hasAlpha() ? dst->getAlphaOffset() : -1 );
+}
+
+//! Copies \a n averaged RGB pixels to \a dst starting at pixel \a x of row \a y.
+static void emitColorBlocks( const uint8_t *rgb, ci::Surface8u *dst, size_t y, size_t x, size_t n )
+{
+	const uint8_t pixelInc = dst->getPixelInc();
+	const uint8_t offsets[ 3 ] = { dst->getRedOffset(), dst->getGreenOffset(), dst->getBlueOffset() };
+	uint8_t *dstPixel = dst->getData() + y * dst->getRowBytes() + x * pixelInc;
+	for ( size_t b = 0; b < n; b++, dstPixel += pixelInc, rgb += 3 )
+	{
+		dstPixel[ offsets[ 0 ] ] = rgb[ 0 ];
+		dstPixel[ offsets[ 1 ] ] = rgb[ 1 ];
+		dstPixel[ offsets[ 2 ] ] = rgb[ 2 ];
+		if ( dst->hasAlpha() )
+		{
+			dstPixel[ dst->getAlphaOffset() ] = 255;
+		}
+	}
+}
+
+void downscale( const ci::Channel8u &src, size_t factor, ci::Surface8u *dst, ParallelStripes *stripes )
+{
+	const uint8_t offset = 0;
+	averageBlocks( src.getData(), src.getRowBytes(), 1, &offset, 1, factor,
+			std::min< size_t >( dst->getWidth(), src.getWidth() / factor ), std::min< size_t >( dst->getHeight(), src.getHeight() / factor ), stripes,
+			[ & ]( size_t y, size_t x, size_t n, const uint16_t *averages )
+			{
+				uint8_t gray[ kBlockChunk ];
+				std::copy( averages, averages + n, gray );
+				emitGrayBlocks( gray, dst, y, x, n );
+			} );
+}
+
+void downscale( const ci::Channel16u &src, size_t factor, const LevelMapping &mapping, ci::Surface8u *dst, ParallelStripes *stripes )
+{
+	const RowMapper mapRow( mapping );
+	const uint8_t offset = 0;
+	averageBlocks( src.getData(), src.getRowBytes(), 1, &offset, 1, factor,
+			std::min< size_t >( dst->getWidth(), src.getWidth() / factor ), std::min< size_t >( dst->getHeight(), src.getHeight() / factor ), stripes,
+			[ & ]( size_t y, size_t x, size_t n, const uint16_t *averages )
+			{
+				uint8_t gray[ kBlockChunk ];
+				mapRow( averages, gray, n );
+				emitGrayBlocks( gray, dst, y, x, n );
+			} );
+}
+
+void downscale( const ci::Surface8u &src, size_t factor, ci::Surface8u *dst, ParallelStripes *stripes )
+{
+	const uint8_t offsets[ 3 ] = { src.getRedOffset(), src.getGreenOffset(), src.getBlueOffset() };
+	averageBlocks( src.getData(), src.getRowBytes(), src.getPixelInc(), offsets, 3, factor,
+			std::min< size_t >( dst->getWidth(), src.getWidth() / factor ), std::min< size_t >( dst->getHeight(), src.getHeight() / factor ), stripes,
+			[ & ]( size_t y, size_t x, size_t n, const uint16_t *averages )
+			{
+				uint8_t rgb[ kBlockChunk * 3 ];
+				std::copy( averages, averages + n * 3, rgb );
+				emitColorBlocks( rgb, dst, y, x, n );
+			} );
+}
+
+void downscale( const ci::Surface16u &src, size_t factor, const LevelMapping &mapping, ci::Surface8u *dst, ParallelStripes *stripes )
+{
+	const RowMapper mapRow( mapping );
+	const uint8_t offsets[ 3 ] = { src.getRedOffset(), src.getGreenOffset(), src.getBlueOffset() };
+	averageBlocks( src.getData(), src.getRowBytes(), src.getPixelInc(), offsets, 3, factor,
+			std::min< size_t >( dst->getWidth(), src.getWidth() / factor ), std::min< size_t >( dst->getHeight(), src.getHeight() / factor ), stripes,
+			[ & ]( size_t y, size_t x, size_t n, const uint16_t *averages )
+			{
+				uint8_t rgb[ kBlockChunk * 3 ];
+				mapRow( averages, rgb, n * 3 );
+				emitColorBlocks( rgb, dst, y, x, n );
+			} );
+}
+
+} } // mndl::pvapi
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "cinder/Channel.h"
+#include "cinder/Surface.h"
+
+#include "FlatFieldCorrection.h"
+#include "FrameStatistics.h"
+#include "Mono12Packed.h"
+#include "ParallelStripes.h"
+#include "SimdLevel.h"
+#include "ToneMap.h"
+
+namespace mndl { namespace pvapi {
+
+//! Unpacks a Mono12Packed frame of the size of \a dst, splitting the rows over \a stripes if not null.
+void unpackMono12Packed( const uint8_t *packed, ci::Channel16u *dst, ParallelStripes *stripes = nullptr );
+
+//! Maps 16-bit levels to 8 bits, the window [ mMinLevel, mMaxLevel ] linearly
+//! to [ 0, 255 ] clamping the levels outside, or through the tone curve table
+//! of the window if mLut is set.
+struct LevelMapping
+{
+	LevelMapping( uint16_t minLevel = 0, uint16_t maxLevel = 0xffff, const ToneLutRef &lut = ToneLutRef() ) :
+		mMinLevel( minLevel ), mMaxLevel( maxLevel ), mLut( lut )
+	{
+	}
+
+	bool operator==( const LevelMapping &rhs ) const
+	{ return mMinLevel == rhs.mMinLevel && mMaxLevel == rhs.mMaxLevel && mLut == rhs.mLut; }
+	bool operator!=( const LevelMapping &rhs ) const { return ! ( *this == rhs ); }
+
+	uint16_t mMinLevel;
+	uint16_t mMaxLevel;
+	ToneLutRef mLut;
+};
+
+//! Unpacks a Mono12Packed frame like the Channel16u version, then corrects
+//! each row with \a correction, adds it to \a stats and maps it to \a dst8u
+//! while it is still in the cache. Any of \a correction, \a stats and
+//! \a dst8u may be null.
+void unpackMono12Packed( const uint8_t *packed, ci::Channel16u *dst, ci::Channel8u *dst8u, const LevelMapping &mapping,
+		const FlatFieldCorrection *correction, FrameStatistics *stats, ParallelStripes *stripes = nullptr );
+
+//! Maps the levels of \a src to \a dst of the same size.
+void convert16uTo8u( const ci::Channel16u &src, ci::Channel8u *dst, const LevelMapping &mapping, ParallelStripes *stripes = nullptr );
+//! Maps the levels of \a src to all color channels of \a dst of the same size.
+void convert16uTo8u( const ci::Channel16u &src, ci::Surface8u *dst, const LevelMapping &mapping, ParallelStripes *stripes = nullptr );
+//! Maps the levels of the color channels of \a src to \a dst of the same size.
+void convert16uTo8u( const ci::Surface16u &src, ci::Surface8u *dst, const LevelMapping &mapping, ParallelStripes *stripes = nullptr );
+//! Maps the gray levels of \a src, weighted like ci::ip::grayscale(), to \a dst of the same size.
+void convert16uTo8u( const ci::Surface16u &src, ci::Channel8u *dst, const LevelMapping &mapping, ParallelStripes *stripes = nullptr );
+//! Scales \a src to the 16-bit range in \a dst of the same size, like the converting constructor of ci::Channel16u.
+void convert8uTo16u( const ci::Channel8u &src, ci::Channel16u *dst, ParallelStripes *stripes = nullptr );
+//! Scales the gray levels of \a src, weighted like ci::ip::grayscale(), to the 16-bit range in \a dst of the same size.
+void convert8uTo16u( const ci::Surface8u &src, ci::Channel16u *dst, ParallelStripes *stripes = nullptr );
+//! Copies \a src to all color channels of \a dst of the same size.
+void convert8uToSurface( const ci::Channel8u &src, ci::Surface8u *dst, ParallelStripes *stripes = nullptr );
+
+//! Packed YUV formats, in the IIDC byte order.
+enum class YuvFormat
+{
+	//! U Y Y V Y Y, four pixels in six bytes
+	YUV411,
+	//! U Y V Y, two pixels in four bytes
+	YUV422,
+	//! U Y V, a pixel in three bytes
+	YUV444
+};
+
+//! Converts the packed YUV frame \a src of the size of \a dst with the JFIF full range equations, splitting the rows over \a stripes if not null.
+void convertYuvToRgb( const uint8_t *src, YuvFormat format, ci::Surface8u *dst, ParallelStripes *stripes = nullptr );
+
+//! Averages blocks of \a factor x \a factor pixels of \a src into all color
+//! channels of \a dst. \a factor is a power of two up to 4, the pixels past
+//! the size of \a dst times \a factor are left out.
+void downscale( const ci::Channel8u &src, size_t factor, ci::Surface8u *dst, ParallelStripes *stripes = nullptr );
+//! Averages blocks like the Channel8u version and maps the averages to 8 bits.
+void downscale( const ci::Channel16u &src, size_t factor, const LevelMapping &mapping, ci::Surface8u *dst, ParallelStripes *stripes = nullptr );
+//! Averages blocks of the color channels of \a src into \a dst of any channel order.
+void downscale( const ci::Surface8u &src, size_t factor, ci::Surface8u *dst, ParallelStripes *stripes = nullptr );
+//! Averages blocks of the color channels like the Surface8u version and maps the averages to 8 bits.
+void downscale( const ci::Surface16u &src, size_t factor, const LevelMapping &mapping, ci::Surface8u *dst, ParallelStripes *stripes = nullptr );
+
+} } // mndl::pvapi
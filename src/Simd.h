@@ -0,0 +1,60 @@
+#pragma once
+
+//! MNDL_PVAPI_X86_SIMD is 1 where the conversions have SSE/AVX versions,
+//! which are compiled with MNDL_PVAPI_TARGET and selected at run time by
+//! getSimdLevel().
+#if ( defined( __x86_64__ ) || defined( __i386__ ) ) && ( defined( __GNUC__ ) || defined( __clang__ ) )
+#define MNDL_PVAPI_X86_SIMD 1
+#include <immintrin.h>
+#define MNDL_PVAPI_TARGET( isa ) __attribute__(( target( isa ) ))
+#else
+#define MNDL_PVAPI_X86_SIMD 0
+#endif
+
+//! Marks a case falling through to the next one, as clang does not take a
+//! comment for it with -Wimplicit-fallthrough.
+#if defined( __has_cpp_attribute )
+#if __has_cpp_attribute( clang::fallthrough )
+#define MNDL_PVAPI_FALLTHROUGH [[clang::fallthrough]]
+#elif __has_cpp_attribute( gnu::fallthrough )
+#define MNDL_PVAPI_FALLTHROUGH [[gnu::fallthrough]]
+#endif
+#endif
+#if ! defined( MNDL_PVAPI_FALLTHROUGH )
+#define MNDL_PVAPI_FALLTHROUGH
+#endif
+
+#if MNDL_PVAPI_X86_SIMD
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mndl { namespace pvapi {
+
+//! Byte shuffles interleaving three vectors of red, green and blue into three vectors of RGB pixels.
+template< typename T >
+struct InterleaveShuffles
+{
+	InterleaveShuffles()
+	{
+		for ( size_t out = 0; out < 3; out++ )
+		{
+			for ( size_t color = 0; color < 3; color++ )
+			{
+				for ( size_t m = 0; m < 16; m++ )
+				{
+					size_t n = out * 16 + m;
+					size_t pixel = n / ( 3 * sizeof( T ) );
+					size_t c = ( n / sizeof( T ) ) % 3;
+					mShuffles[ out ][ color ][ m ] = int8_t( c == color ? pixel * sizeof( T ) + n % sizeof( T ) : 0x80 );
+				}
+			}
+		}
+	}
+
+	alignas( 16 ) int8_t mShuffles[ 3 ][ 3 ][ 16 ];
+};
+
+} } // mndl::pvapi
+
+#endif
@@ -0,0 +1,43 @@
+#include <algorithm>
+#include <atomic>
+
+#include "Simd.h"
+#include "SimdLevel.h"
+
+namespace mndl { namespace pvapi {
+
+static SimdLevel detectSimdLevel()
+{
+#if MNDL_PVAPI_X86_SIMD
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports( "avx2" ) )
+	{
+		return SimdLevel::AVX2;
+	}
+	if ( __builtin_cpu_supports( "ssse3" ) )
+	{
+		return SimdLevel::SSSE3;
+	}
+	// always true on x86-64, only 32-bit builds may run without it
+	if ( __builtin_cpu_supports( "sse2" ) )
+	{
+		return SimdLevel::SSE2;
+	}
+#endif
+	return SimdLevel::SCALAR;
+}
+
+static const SimdLevel sSupportedSimdLevel = detectSimdLevel();
+static std::atomic< SimdLevel > sMaxSimdLevel { SimdLevel::AVX2 };
+
+SimdLevel getSimdLevel()
+{
+	return std::min( sSupportedSimdLevel, sMaxSimdLevel.load( std::memory_order_relaxed ) );
+}
+
+void setMaxSimdLevel( SimdLevel level )
+{
+	sMaxSimdLevel = level;
+}
+
+} } // mndl::pvapi
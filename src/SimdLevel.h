@@ -0,0 +1,20 @@
+#pragma once
+
+namespace mndl { namespace pvapi {
+
+//! Instruction sets the conversions are implemented with. Each one includes
+//! the ones before it, the kernels check for the lowest level they need.
+enum class SimdLevel
+{
+	SCALAR,
+	SSE2,
+	SSSE3,
+	AVX2
+};
+
+//! Returns the instruction set the conversions use, the best one supported by the CPU unless capped by setMaxSimdLevel().
+SimdLevel getSimdLevel();
+//! Caps the instruction set used by the conversions, for comparing the implementations.
+void setMaxSimdLevel( SimdLevel level );
+
+} } // mndl::pvapi
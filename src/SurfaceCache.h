@@ -1,53 +1,74 @@
 #pragma once
 
-#include <vector>
+#include <memory>
 
 #include "cinder/Cinder.h"
 #include "cinder/Surface.h"
 
+#include "BlockPool.h"
+
+//! Blocks of pixel data wrapped into surfaces, like ChannelCacheT.
 template< typename T >
 class SurfaceCacheT
 {
   public:
-	SurfaceCacheT( int32_t width, int32_t height, ci::SurfaceChannelOrder sco, int numSurfaces ) :
-		mWidth( width ), mHeight( height ), mSCO( sco )
+	SurfaceCacheT( int32_t width, int32_t height, ci::SurfaceChannelOrder sco, int numSurfaces,
+			const mndl::pvapi::FrameBufferOptions &options = mndl::pvapi::FrameBufferOptions() ) :
+		mWidth( width ), mHeight( height ), mSCO( sco ),
+		mRowBytes( mndl::pvapi::getPaddedRowBytes( width * sco.getPixelInc() * sizeof( T ), options.mRowAlignment ) ),
+		mPool( mndl::pvapi::BlockPool::create( mRowBytes * height, options ) )
 	{
-		for ( int i = 0; i < numSurfaces; ++i )
-		{
-			mSurfaceData.push_back( std::shared_ptr< T >( new T[ width * height * sco.getPixelInc() ], std::default_delete< T [] >() ) );
-			mSurfaceUsed.push_back( false );
-		}
+		reserve( numSurfaces );
 	}
 
+	//! Grows the cache to hold at least \a numSurfaces blocks of pixel data, up to BlockPool::kMaxBlocks.
+	void reserve( size_t numSurfaces ) { mPool->reserve( numSurfaces ); }
+
+	size_t size() const { return mPool->size(); }
+	int32_t getWidth() const { return mWidth; }
+	int32_t getHeight() const { return mHeight; }
+	const ci::SurfaceChannelOrder & getChannelOrder() const { return mSCO; }
+	size_t getRowBytes() const { return mRowBytes; }
+	const mndl::pvapi::FrameBufferOptions & getOptions() const { return mPool->getOptions(); }
+
+	//! Sets the budget the cache grows within when all of its blocks are taken, see BlockPool.
+	void setBudget( const mndl::pvapi::PoolBudgetRef &budget ) { mPool->setBudget( budget ); }
+	mndl::pvapi::PoolStats getStats() const { return mPool->getStats(); }
+	void resetStats() { mPool->resetStats(); }
+
+	//! Changes the size of the surfaces like ChannelCacheT::resize().
 	void resize( int32_t width, int32_t height )
 	{
+		if ( width == mWidth && height == mHeight )
+		{
+			return;
+		}
+
+		const size_t numSurfaces = mPool->size();
+		const mndl::pvapi::FrameBufferOptions options = mPool->getOptions();
 		mWidth = width;
 		mHeight = height;
+		mRowBytes = mndl::pvapi::getPaddedRowBytes( width * mSCO.getPixelInc() * sizeof( T ), options.mRowAlignment );
+		mndl::pvapi::BlockPoolRef pool = mndl::pvapi::BlockPool::create( mRowBytes * height, options );
+		pool->setBudget( mPool->getBudget() );
+		pool->reserve( numSurfaces );
+		mPool = pool;
 	}
 
 	std::shared_ptr< ci::SurfaceT< T > > getNewSurface()
 	{
-		// try to find an available block of pixel data to wrap a surface around
-		for ( size_t i = 0; i < mSurfaceData.size(); ++i )
-		{
-			if ( ! mSurfaceUsed[ i ] )
-			{
-				mSurfaceUsed[ i ] = true;
-				auto newSurface = new ci::SurfaceT< T >( mSurfaceData[ i ].get(), mWidth, mHeight, mWidth * mSCO.getPixelInc(), mSCO );
-				std::shared_ptr< ci::SurfaceT< T > > result = std::shared_ptr< ci::SurfaceT< T > >( newSurface, [=] ( ci::SurfaceT< T > *s ) { mSurfaceUsed[ i ] = false; } );
-				return result;
-			}
-		}
-
-		// we couldn't find an available surface, so we'll need to allocate one
-		return ci::SurfaceT< T >::create( mWidth, mHeight, mSCO.hasAlpha(), mSCO );
+		// take an available block of pixel data to wrap a surface around, the pool grows if there is none
+		mndl::pvapi::BlockPool::Block block = mPool->acquire();
+		auto newSurface = new ci::SurfaceT< T >( reinterpret_cast< T * >( block.mData.get() ), mWidth, mHeight, mRowBytes, mSCO );
+		std::weak_ptr< mndl::pvapi::BlockPool > pool = mPool;
+		return std::shared_ptr< ci::SurfaceT< T > >( newSurface, [pool, block] ( ci::SurfaceT< T > *s ) { mndl::pvapi::BlockPool::release( pool, block.mIndex ); delete s; } );
 	}
 
   private:
-	std::vector< std::shared_ptr< T > > mSurfaceData;
-	std::vector< bool > mSurfaceUsed;
 	int32_t mWidth, mHeight;
 	ci::SurfaceChannelOrder mSCO;
+	size_t mRowBytes;
+	mndl::pvapi::BlockPoolRef mPool;
 };
 
 typedef SurfaceCacheT< uint8_t > SurfaceCache;
@@ -0,0 +1,85 @@
+#include <algorithm>
+#include <cmath>
+
+#include "ToneMap.h"
+
+namespace mndl { namespace pvapi {
+
+void ToneMap::setGamma( float gamma )
+{
+	const float exponent = 1.0f / std::max( gamma, 1e-3f );
+	setCurve( [ exponent ]( float t ) { return std::pow( t, exponent ); } );
+}
+
+void ToneMap::setLog( float strength )
+{
+	const float k = std::max( strength, 1e-3f );
+	const float scale = 1.0f / std::log1p( k );
+	setCurve( [ k, scale ]( float t ) { return std::log1p( k * t ) * scale; } );
+}
+
+void ToneMap::setCurve( const std::function< float( float ) > &curve )
+{
+	std::lock_guard< std::mutex > lock( mMutex );
+	mCurve = curve;
+	mHasCurve = bool( curve );
+	std::atomic_store( &mLut, ToneLutRef() );
+}
+
+bool ToneMap::isLinear() const
+{
+	return ! mHasCurve;
+}
+
+//! Returns whether \a lut is the table of the window [ \a minLevel, \a maxLevel ] with \a size entries.
+static bool isLutOf( const ToneLutRef &lut, uint16_t minLevel, uint16_t maxLevel, size_t size )
+{
+	return lut && lut->mMinLevel == minLevel && lut->mMaxLevel == maxLevel && lut->mTable.size() == size;
+}
+
+ToneLutRef ToneMap::getLut( uint16_t minLevel, uint16_t maxLevel, uint32_t bitDepth )
+{
+	if ( ! mHasCurve )
+	{
+		return ToneLutRef();
+	}
+
+	// called for every frame converted or displayed, so the table is only
+	// loaded while neither the curve nor the window change
+	const size_t size = ( bitDepth <= 12 && maxLevel < 4096 ) ? 4096 : 65536;
+	ToneLutRef current = std::atomic_load( &mLut );
+	if ( isLutOf( current, minLevel, maxLevel, size ) )
+	{
+		return current;
+	}
+
+	std::lock_guard< std::mutex > lock( mMutex );
+	if ( ! mCurve )
+	{
+		return ToneLutRef();
+	}
+	// another thread may have built it while this one waited
+	current = std::atomic_load( &mLut );
+	if ( isLutOf( current, minLevel, maxLevel, size ) )
+	{
+		return current;
+	}
+
+	// the previous table stays valid for the frames converting with it
+	std::shared_ptr< ToneLut > lut = std::make_shared< ToneLut >();
+	lut->mMinLevel = minLevel;
+	lut->mMaxLevel = maxLevel;
+	lut->mTable.resize( size );
+	const float low = std::min( minLevel, maxLevel );
+	const float range = std::max( float( std::max( minLevel, maxLevel ) ) - low, 1.0f );
+	for ( size_t v = 0; v < size; v++ )
+	{
+		float t = std::min( std::max( ( float( v ) - low ) / range, 0.0f ), 1.0f );
+		float y = std::min( std::max( mCurve( t ), 0.0f ), 1.0f );
+		lut->mTable[ v ] = uint8_t( std::lround( y * 255.0f ) );
+	}
+	std::atomic_store( &mLut, ToneLutRef( lut ) );
+	return lut;
+}
+
+} } // mndl::pvapi
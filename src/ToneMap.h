@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace mndl { namespace pvapi {
+
+//! Table mapping the levels of a high bit depth frame to 8 bits.
+struct ToneLut
+{
+	//! Returns the 8-bit level of \a v, levels past the end of the table map to its last entry.
+	uint8_t map( uint16_t v ) const { return mTable[ v < mTable.size() ? v : mTable.size() - 1 ]; }
+
+	uint16_t mMinLevel;
+	uint16_t mMaxLevel;
+	//! 4096 entries for frames of up to 12 bits, 65536 otherwise
+	std::vector< uint8_t > mTable;
+};
+
+typedef std::shared_ptr< const ToneLut > ToneLutRef;
+
+//! Tone curve applied to the level window of high bit depth frames when they
+//! are converted to 8 bits. The curve maps the window normalized to [0, 1] to
+//! [0, 1]. It is sampled into a table, which is rebuilt only when the curve or
+//! the window changes. The current table is read without locking, the mutex is
+//! only taken to set the curve or to rebuild the table.
+class ToneMap
+{
+  public:
+	//! Maps the window linearly, without a table. This is the default.
+	void setLinear() { setCurve( std::function< float( float ) >() ); }
+	//! Applies t^( 1 / gamma ).
+	void setGamma( float gamma );
+	//! Applies log( 1 + strength * t ) / log( 1 + strength ), brightening the shadows.
+	void setLog( float strength );
+	//! Applies \a curve, which is called from [0, 1] to [0, 1] while the table is built.
+	void setCurve( const std::function< float( float ) > &curve );
+
+	//! Returns whether no curve is set.
+	bool isLinear() const;
+
+	//! Returns the table of the window [ \a minLevel, \a maxLevel ] of a frame of \a bitDepth bits, null if linear.
+	ToneLutRef getLut( uint16_t minLevel, uint16_t maxLevel, uint32_t bitDepth );
+
+  private:
+	//! guards mCurve and the rebuild of mLut
+	mutable std::mutex mMutex;
+	std::function< float( float ) > mCurve;
+	std::atomic< bool > mHasCurve { false };
+	//! loaded and stored atomically
+	ToneLutRef mLut;
+};
+
+} } // mndl::pvapi
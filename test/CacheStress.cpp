@@ -0,0 +1,389 @@
+// Stress test of the lock-free free list and of the channel and surface
+// caches built on it, meant to be run under ThreadSanitizer and
+// AddressSanitizer. It builds the real ChannelCacheT and SurfaceCacheT
+// against the minimal stand-ins for Cinder in test/cinder and is built by
+// hand:
+//
+//   c++ -std=c++14 -O1 -g -fsanitize=thread -I. -I../src CacheStress.cpp ../src/BlockPool.cpp ../src/FrameAllocator.cpp -lpthread -o CacheStress
+//   ./CacheStress
+//
+// and again with -fsanitize=address. Exits with 0 if all checks passed.
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ChannelCache.h"
+#include "FreeList.h"
+#include "SurfaceCache.h"
+
+using namespace mndl::pvapi;
+
+#define CHECK( condition ) \
+	do \
+	{ \
+		if ( ! ( condition ) ) \
+		{ \
+			fprintf( stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition ); \
+			std::abort(); \
+		} \
+	} \
+	while ( 0 )
+
+static const size_t kNumThreads = 8;
+
+template< typename Fn >
+static void runThreads( size_t numThreads, Fn fn )
+{
+	std::vector< std::thread > threads;
+	for ( size_t i = 0; i < numThreads; i++ )
+	{
+		threads.emplace_back( fn, i );
+	}
+	for ( auto &thread : threads )
+	{
+		thread.join();
+	}
+}
+
+//! Pops and pushes indices from all threads. An index must never be held by
+//! two threads at once, and the list must hold every index at the end.
+static void testFreeList()
+{
+	const size_t capacity = 16;
+	const size_t numIterations = 200000;
+
+	FreeList freeList( capacity );
+	for ( size_t i = 0; i < capacity; i++ )
+	{
+		freeList.push( i );
+	}
+
+	// plain data guarded only by taking the index from the list, so a
+	// broken list shows up as a data race as well as a failed check
+	std::vector< std::atomic< bool > > held( capacity );
+	std::vector< size_t > owners( capacity );
+	for ( auto &h : held )
+	{
+		h = false;
+	}
+
+	runThreads( kNumThreads, [ & ]( size_t thread )
+			{
+				size_t taken[ 3 ];
+				for ( size_t i = 0; i < numIterations; i++ )
+				{
+					// hold up to 3 indices at once and return them in the
+					// order they were taken, so that the top goes back while
+					// the one below it is still held, which is where an
+					// untagged head would let a stale pop through
+					const size_t numTaken = i % 3 + 1;
+					size_t n = 0;
+					while ( n < numTaken && freeList.pop( &taken[ n ] ) )
+					{
+						CHECK( taken[ n ] < capacity );
+						CHECK( ! held[ taken[ n ] ].exchange( true ) );
+						owners[ taken[ n ] ] = thread;
+						n++;
+					}
+					for ( size_t j = 0; j < n; j++ )
+					{
+						CHECK( owners[ taken[ j ] ] == thread );
+						held[ taken[ j ] ] = false;
+						freeList.push( taken[ j ] );
+					}
+				}
+			} );
+
+	std::vector< bool > seen( capacity, false );
+	size_t index;
+	for ( size_t i = 0; i < capacity; i++ )
+	{
+		CHECK( freeList.pop( &index ) );
+		CHECK( index < capacity && ! seen[ index ] );
+		seen[ index ] = true;
+	}
+	CHECK( ! freeList.pop( &index ) );
+}
+
+//! Fills the pixel data of \a image with \a pattern.
+template< typename Image >
+static void fill( Image &image, uint8_t pattern )
+{
+	memset( image.getData(), pattern, image.getRowBytes() * image.getHeight() );
+}
+
+//! Returns whether all pixel data of \a image is \a pattern, sampled every 64 bytes.
+template< typename Image >
+static bool isFilled( const Image &image, uint8_t pattern )
+{
+	const uint8_t *data = reinterpret_cast< const uint8_t * >( image.getData() );
+	const size_t numBytes = image.getRowBytes() * image.getHeight();
+	for ( size_t i = 0; i < numBytes; i += 64 )
+	{
+		if ( data[ i ] != pattern )
+		{
+			return false;
+		}
+	}
+	return data[ numBytes - 1 ] == pattern;
+}
+
+static std::shared_ptr< ci::ChannelT< uint16_t > > getNew( ChannelCache16u &cache ) { return cache.getNewChannel(); }
+static std::shared_ptr< ci::SurfaceT< uint16_t > > getNew( SurfaceCache16u &cache ) { return cache.getNewSurface(); }
+
+//! Takes channels from a cache which is replaced and destroyed while
+//! channels are held, like the caches rebuilt by CapturePvApi::start().
+//! Channels are passed between threads and released on another thread than
+//! the one taking them.
+static void testCacheReplacement()
+{
+	const int32_t width = 4096;
+	const size_t numIterations = 20000;
+
+	PoolBudgetRef budget = PoolBudget::create( 24 * width );
+	ChannelCache8uRef cache = std::make_shared< ChannelCache8u >( width, 1, 4 );
+	cache->setBudget( budget );
+
+	// channels handed from one thread to another
+	std::mutex handoffMutex;
+	std::vector< ci::Channel8uRef > handoff;
+
+	std::atomic< size_t > numDone { 0 };
+	runThreads( kNumThreads + 1, [ & ]( size_t thread )
+			{
+				if ( thread == kNumThreads )
+				{
+					// replaces the cache while the others take and return channels
+					while ( numDone < kNumThreads )
+					{
+						ChannelCache8uRef newCache = std::make_shared< ChannelCache8u >( width, 1, 0 );
+						newCache->setBudget( budget );
+						newCache->reserve( 4 );
+						std::atomic_store( &cache, newCache );
+						std::this_thread::yield();
+					}
+					return;
+				}
+
+				const uint8_t pattern = uint8_t( thread + 1 );
+				std::vector< ci::Channel8uRef > channels;
+				for ( size_t i = 0; i < numIterations; i++ )
+				{
+					ci::Channel8uRef channel = std::atomic_load( &cache )->getNewChannel();
+					CHECK( reinterpret_cast< uintptr_t >( channel->getData() ) % kFrameBufferAlignment == 0 );
+					fill( *channel, pattern );
+					channels.push_back( channel );
+
+					if ( i % 7 == 0 )
+					{
+						std::lock_guard< std::mutex > lock( handoffMutex );
+						handoff.push_back( std::move( channels.back() ) );
+						channels.pop_back();
+					}
+					else
+					if ( i % 5 == 0 )
+					{
+						std::lock_guard< std::mutex > lock( handoffMutex );
+						if ( ! handoff.empty() )
+						{
+							handoff.pop_back();
+						}
+					}
+
+					// no other thread wrote to the channels held
+					if ( channels.size() >= 4 )
+					{
+						for ( const auto &c : channels )
+						{
+							CHECK( isFilled( *c, pattern ) );
+						}
+						channels.clear();
+					}
+				}
+				numDone++;
+			} );
+
+	// the channels still held outlive the caches they came from
+	ChannelCache8uRef lastCache = cache;
+	cache.reset();
+	{
+		std::lock_guard< std::mutex > lock( handoffMutex );
+		CHECK( ! handoff.empty() );
+		for ( const auto &channel : handoff )
+		{
+			fill( *channel, 0 );
+		}
+	}
+	CHECK( lastCache->getStats().mNumBlocks <= BlockPool::kMaxBlocks );
+	lastCache.reset();
+	handoff.clear();
+
+	// nothing counts against the budget once the caches and their channels are gone
+	CHECK( budget->getNumBytes() == 0 );
+}
+
+//! One thread takes images from \a cache and resizes it between them while
+//! the other threads check and release the images taken before, so blocks
+//! of the old sizes return to pools the cache dropped. Every image must
+//! keep the size and the pixel data it was taken with.
+template< typename Cache >
+static void testResize( Cache &cache )
+{
+	typedef decltype( getNew( cache ) ) ImageRef;
+	struct Item
+	{
+		ImageRef mImage;
+		int32_t mWidth;
+		uint8_t mPattern;
+	};
+
+	const size_t numIterations = 20000;
+	const int32_t widths[] = { 64, 96, 128, 48 };
+	const int32_t height = 8;
+	PoolBudgetRef budget = PoolBudget::create( size_t( 1 ) << 20 );
+	cache.setBudget( budget );
+
+	std::mutex queueMutex;
+	std::vector< Item > queue;
+	std::atomic< bool > done { false };
+	runThreads( kNumThreads, [ & ]( size_t thread )
+			{
+				if ( thread == 0 )
+				{
+					// the only thread taking images, as resize() requires
+					for ( size_t i = 0; i < numIterations; i++ )
+					{
+						if ( i % 16 == 0 )
+						{
+							cache.resize( widths[ i / 16 % 4 ], height );
+						}
+						Item item { getNew( cache ), cache.getWidth(), uint8_t( i ) };
+						CHECK( item.mImage->getWidth() == item.mWidth && item.mImage->getHeight() == height );
+						fill( *item.mImage, item.mPattern );
+
+						std::lock_guard< std::mutex > lock( queueMutex );
+						queue.push_back( std::move( item ) );
+					}
+					done = true;
+					return;
+				}
+
+				for ( ;; )
+				{
+					// done is set after the last image is queued
+					const bool wasDone = done;
+					Item item;
+					{
+						std::lock_guard< std::mutex > lock( queueMutex );
+						if ( ! queue.empty() )
+						{
+							item = std::move( queue.back() );
+							queue.pop_back();
+						}
+					}
+					if ( ! item.mImage )
+					{
+						if ( wasDone )
+						{
+							return;
+						}
+						std::this_thread::yield();
+						continue;
+					}
+					CHECK( item.mImage->getWidth() == item.mWidth && item.mImage->getHeight() == height );
+					CHECK( isFilled( *item.mImage, item.mPattern ) );
+					item.mImage.reset();
+				}
+			} );
+
+	const PoolStats stats = cache.getStats();
+	CHECK( stats.mNumInUse == 0 );
+	CHECK( stats.mNumBlocks <= BlockPool::kMaxBlocks );
+	// only the blocks of the current pool are left to count against the budget
+	CHECK( budget->getNumBytes() == stats.mNumBlocks * cache.getRowBytes() * height );
+}
+
+//! All channels return to a cache which outlives them, the cache ends up with
+//! every block free and no block in use.
+static void testCacheRelease()
+{
+	ChannelCache8u cache( 256, 1, 8 );
+
+	runThreads( kNumThreads, [ & ]( size_t thread )
+			{
+				std::vector< ci::Channel8uRef > channels;
+				for ( size_t i = 0; i < 20000; i++ )
+				{
+					channels.push_back( cache.getNewChannel() );
+					if ( channels.size() > thread % 3 )
+					{
+						channels.clear();
+					}
+				}
+			} );
+
+	const PoolStats stats = cache.getStats();
+	CHECK( stats.mNumInUse == 0 );
+	CHECK( stats.mNumAcquired == kNumThreads * 20000 );
+	CHECK( stats.mHighWater <= kNumThreads * 3 );
+
+	// every block of the cache is free again
+	std::vector< ci::Channel8uRef > channels;
+	for ( size_t i = 0; i < stats.mNumBlocks; i++ )
+	{
+		channels.push_back( cache.getNewChannel() );
+	}
+	CHECK( cache.getStats().mNumMisses == stats.mNumMisses );
+}
+
+//! A block counts against the budget until it is freed, also while a
+//! channel holds it after its cache is gone. The blocks allocated on their
+//! own past the budget are not counted.
+static void testBudget()
+{
+	const int32_t width = 1024;
+	PoolBudgetRef budget = PoolBudget::create( 3 * width );
+	ChannelCache8uRef cache = std::make_shared< ChannelCache8u >( width, 1, 2 );
+	cache->setBudget( budget );
+	CHECK( budget->getNumBytes() == 2 * width );
+
+	// the third block grows the cache, the fourth is past the budget
+	std::vector< ci::Channel8uRef > channels;
+	for ( size_t i = 0; i < 4; i++ )
+	{
+		channels.push_back( cache->getNewChannel() );
+	}
+	CHECK( cache->getStats().mNumGrown == 1 );
+	CHECK( budget->getNumBytes() == 3 * width );
+
+	// the fallback is freed, the block taken from the cache stays counted
+	channels[ 3 ].reset();
+	CHECK( budget->getNumBytes() == 3 * width );
+	cache.reset();
+	CHECK( budget->getNumBytes() == 3 * width );
+	channels[ 0 ].reset();
+	CHECK( budget->getNumBytes() == 2 * width );
+	channels.clear();
+	CHECK( budget->getNumBytes() == 0 );
+}
+
+int main()
+{
+	testFreeList();
+	testCacheReplacement();
+	testCacheRelease();
+	testBudget();
+
+	ChannelCache16u channelCache( 32, 8, 4 );
+	testResize( channelCache );
+	SurfaceCache16u surfaceCache( 32, 8, ci::SurfaceChannelOrder::RGB, 4 );
+	testResize( surfaceCache );
+	printf( "ok\n" );
+	return 0;
+}
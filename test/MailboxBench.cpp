@@ -0,0 +1,180 @@
+// Contention microbenchmark of FrameMailboxT against the mutex guarded
+// current frame it replaced, which the capture thread and the readers
+// locked for every publish and fetch. One producer publishes frames while
+// readers fetch in a loop, the latencies of both sides are reported as
+// percentiles. It also checks that no reader sees a torn or older value, so
+// it doubles as a ThreadSanitizer test. It does not depend on Cinder and is
+// built by hand:
+//
+//   c++ -std=c++14 -O2 -I../src MailboxBench.cpp -lpthread -o MailboxBench
+//   ./MailboxBench
+//
+// Build with -O1 -g -fsanitize=thread for the race check, the timings are
+// meaningless then.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "FrameMailbox.h"
+
+using namespace mndl::pvapi;
+
+#define CHECK( condition ) \
+	do \
+	{ \
+		if ( ! ( condition ) ) \
+		{ \
+			fprintf( stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition ); \
+			std::abort(); \
+		} \
+	} \
+	while ( 0 )
+
+typedef std::chrono::steady_clock Clock;
+
+//! Stands in for CapturePvApi::Frame, a few references and plain fields copied by every fetch.
+struct Value
+{
+	uint64_t mSequence = 0;
+	std::shared_ptr< uint64_t > mChannel;
+	std::shared_ptr< uint64_t > mSurface;
+	std::shared_ptr< uint64_t > mConversions;
+};
+
+//! The current frame before FrameMailboxT, guarded by one mutex for publishing and reading.
+class MutexSlot
+{
+  public:
+	bool publish( Value value )
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		mValue = std::move( value );
+		bool replaced = mHasNew;
+		mHasNew = true;
+		return replaced;
+	}
+
+	Value fetch( bool *isNew = nullptr )
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		if ( isNew )
+		{
+			*isNew = mHasNew;
+		}
+		mHasNew = false;
+		return mValue;
+	}
+
+  private:
+	std::mutex mMutex;
+	Value mValue;
+	bool mHasNew = false;
+};
+
+//! Sorted latencies in nanoseconds.
+struct Latencies
+{
+	std::vector< uint32_t > mSamples;
+
+	void add( Clock::duration d )
+	{
+		mSamples.push_back( uint32_t( std::min< int64_t >( std::chrono::duration_cast< std::chrono::nanoseconds >( d ).count(), UINT32_MAX ) ) );
+	}
+
+	void print( const char *name )
+	{
+		if ( mSamples.empty() )
+		{
+			return;
+		}
+		std::sort( mSamples.begin(), mSamples.end() );
+		auto at = [ this ]( double q ) { return mSamples[ std::min( mSamples.size() - 1, size_t( q * mSamples.size() ) ) ]; };
+		printf( "  %-8s p50 %6u ns  p99 %7u ns  p99.9 %8u ns  max %9u ns  (%zu samples)\n",
+				name, at( 0.5 ), at( 0.99 ), at( 0.999 ), mSamples.back(), mSamples.size() );
+	}
+};
+
+template< typename Mailbox >
+static void run( const char *name, size_t numReaders, size_t numFrames )
+{
+	Mailbox mailbox;
+	std::atomic< bool > done { false };
+	std::vector< Latencies > fetchLatencies( numReaders );
+	Latencies publishLatencies;
+
+	std::vector< std::thread > readers;
+	for ( size_t r = 0; r < numReaders; r++ )
+	{
+		readers.emplace_back( [ &, r ]
+				{
+					uint64_t last = 0;
+					while ( ! done.load( std::memory_order_relaxed ) )
+					{
+						bool isNew;
+						Clock::time_point start = Clock::now();
+						Value value = mailbox.fetch( &isNew );
+						fetchLatencies[ r ].add( Clock::now() - start );
+
+						// whole values only, and never older than one fetched before
+						CHECK( value.mSequence >= last );
+						if ( value.mSequence != 0 )
+						{
+							CHECK( *value.mChannel == value.mSequence && *value.mSurface == value.mSequence && *value.mConversions == value.mSequence );
+						}
+						last = value.mSequence;
+					}
+				} );
+	}
+
+	for ( uint64_t i = 1; i <= numFrames; i++ )
+	{
+		Value value;
+		value.mSequence = i;
+		value.mChannel = std::make_shared< uint64_t >( i );
+		value.mSurface = std::make_shared< uint64_t >( i );
+		value.mConversions = std::make_shared< uint64_t >( i );
+
+		Clock::time_point start = Clock::now();
+		mailbox.publish( std::move( value ) );
+		publishLatencies.add( Clock::now() - start );
+
+		// a fast camera, a frame every 20us
+		Clock::time_point next = start + std::chrono::microseconds( 20 );
+		while ( Clock::now() < next )
+		{
+		}
+	}
+	done = true;
+	for ( auto &reader : readers )
+	{
+		reader.join();
+	}
+
+	Latencies fetches;
+	for ( auto &latencies : fetchLatencies )
+	{
+		fetches.mSamples.insert( fetches.mSamples.end(), latencies.mSamples.begin(), latencies.mSamples.end() );
+	}
+	printf( "%s, %zu readers\n", name, numReaders );
+	publishLatencies.print( "publish" );
+	fetches.print( "fetch" );
+}
+
+int main( int argc, char **argv )
+{
+	const size_t numFrames = argc > 1 ? size_t( atol( argv[ 1 ] ) ) : 100000;
+	printf( "%u hardware threads, %zu frames\n", std::thread::hardware_concurrency(), numFrames );
+	for ( size_t numReaders : { 1, 2, 4 } )
+	{
+		run< MutexSlot >( "mutex (before)", numReaders, numFrames );
+		run< FrameMailboxT< Value > >( "FrameMailboxT", numReaders, numFrames );
+	}
+	return 0;
+}
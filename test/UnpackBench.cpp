@@ -0,0 +1,105 @@
+// Benchmark of unpackMono12Packed() against the loop it replaced, on a 5 MP
+// frame of 2448x2048 pixels. Every version is checked against the old loop
+// before it is timed. It does not depend on Cinder and is built by hand:
+//
+//   c++ -std=c++14 -O2 -I../src UnpackBench.cpp ../src/Mono12Packed.cpp ../src/SimdLevel.cpp -o UnpackBench
+//   ./UnpackBench [ numRuns ]
+//
+// Reports the median time per frame of each version on one core.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "Mono12Packed.h"
+#include "SimdLevel.h"
+
+using namespace mndl::pvapi;
+
+typedef std::chrono::steady_clock Clock;
+
+static const size_t kWidth = 2448;
+static const size_t kHeight = 2048;
+
+//! The unpacking loop of CapturePvApi before the vector versions, the reference.
+static void unpackReference( const uint8_t *src, size_t n, uint16_t *dst )
+{
+	for ( size_t i = 0; i < n / 2; i++, dst += 2, src += 3 )
+	{
+		uint16_t p0 = src[ 0 ];
+		uint16_t p01 = src[ 1 ];
+		uint16_t p1 = src[ 2 ];
+		dst[ 0 ] = ( p0 << 4 ) | (( p01 & 0xf0 ) >> 4 );
+		dst[ 1 ] = ( ( p01 & 0xf ) << 8 ) | p1;
+	}
+}
+
+//! Returns the median milliseconds per call of \a fn over \a numRuns runs.
+template< typename Fn >
+static double measure( size_t numRuns, Fn fn )
+{
+	std::vector< double > times;
+	for ( size_t i = 0; i < numRuns; i++ )
+	{
+		Clock::time_point start = Clock::now();
+		fn();
+		times.push_back( std::chrono::duration< double, std::milli >( Clock::now() - start ).count() );
+	}
+	std::sort( times.begin(), times.end() );
+	return times[ times.size() / 2 ];
+}
+
+int main( int argc, char **argv )
+{
+	const size_t numRuns = argc > 1 ? size_t( atol( argv[ 1 ] ) ) : 50;
+	const size_t numPixels = kWidth * kHeight;
+
+	std::vector< uint8_t > packed( numPixels / 2 * 3 );
+	std::mt19937 random( 1 );
+	for ( auto &b : packed )
+	{
+		b = uint8_t( random() );
+	}
+
+	std::vector< uint16_t > expected( numPixels );
+	std::vector< uint16_t > unpacked( numPixels );
+	unpackReference( packed.data(), numPixels, expected.data() );
+
+	printf( "%zux%zu Mono12Packed, median of %zu runs\n", kWidth, kHeight, numRuns );
+	const double reference = measure( numRuns, [ & ] { unpackReference( packed.data(), numPixels, unpacked.data() ); } );
+	printf( "  old loop  %6.2f ms\n", reference );
+
+	const struct
+	{
+		SimdLevel mLevel;
+		const char *mName;
+	} levels[] = { { SimdLevel::SCALAR, "scalar" }, { SimdLevel::SSSE3, "SSSE3" }, { SimdLevel::AVX2, "AVX2" } };
+
+	int result = 0;
+	for ( const auto &level : levels )
+	{
+		setMaxSimdLevel( level.mLevel );
+		if ( getSimdLevel() != level.mLevel )
+		{
+			printf( "  %-8s  not supported by this CPU\n", level.mName );
+			continue;
+		}
+
+		std::fill( unpacked.begin(), unpacked.end(), 0 );
+		unpackMono12Packed( packed.data(), 0, numPixels, unpacked.data() );
+		if ( unpacked != expected )
+		{
+			printf( "  %-8s  differs from the old loop\n", level.mName );
+			result = 1;
+			continue;
+		}
+
+		const double time = measure( numRuns, [ & ] { unpackMono12Packed( packed.data(), 0, numPixels, unpacked.data() ); } );
+		printf( "  %-8s  %6.2f ms  %4.1fx\n", level.mName, time, reference / time );
+	}
+	return result;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "cinder/Cinder.h"
+
+namespace cinder {
+
+//! A channel wrapped around pixel data it does not own, like ci::ChannelT.
+template< typename T >
+class ChannelT
+{
+  public:
+	ChannelT( int32_t width, int32_t height, ptrdiff_t rowBytes, uint8_t increment, T *data ) :
+		mWidth( width ), mHeight( height ), mRowBytes( rowBytes ), mIncrement( increment ), mData( data )
+	{
+	}
+
+	int32_t getWidth() const { return mWidth; }
+	int32_t getHeight() const { return mHeight; }
+	ptrdiff_t getRowBytes() const { return mRowBytes; }
+	uint8_t getIncrement() const { return mIncrement; }
+	T * getData() { return mData; }
+	const T * getData() const { return mData; }
+
+  private:
+	int32_t mWidth, mHeight;
+	ptrdiff_t mRowBytes;
+	uint8_t mIncrement;
+	T *mData;
+};
+
+typedef ChannelT< uint8_t > Channel8u;
+typedef std::shared_ptr< Channel8u > Channel8uRef;
+typedef ChannelT< uint16_t > Channel16u;
+typedef std::shared_ptr< Channel16u > Channel16uRef;
+
+} // namespace cinder
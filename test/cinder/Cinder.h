@@ -0,0 +1,12 @@
+#pragma once
+
+// Stands in for Cinder in the harnesses of test/, only what the caches use.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace cinder {
+}
+
+namespace ci = cinder;
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "cinder/Cinder.h"
+
+namespace cinder {
+
+//! Channel order of a surface, only the number of channels of ci::SurfaceChannelOrder.
+class SurfaceChannelOrder
+{
+  public:
+	enum { RGB = 3, RGBA = 4 };
+
+	SurfaceChannelOrder( int code = RGBA ) : mCode( code ) {}
+
+	uint8_t getPixelInc() const { return uint8_t( mCode ); }
+
+  private:
+	int mCode;
+};
+
+//! A surface wrapped around pixel data it does not own, like ci::SurfaceT.
+template< typename T >
+class SurfaceT
+{
+  public:
+	SurfaceT( T *data, int32_t width, int32_t height, ptrdiff_t rowBytes, SurfaceChannelOrder channelOrder ) :
+		mData( data ), mWidth( width ), mHeight( height ), mRowBytes( rowBytes ), mChannelOrder( channelOrder )
+	{
+	}
+
+	int32_t getWidth() const { return mWidth; }
+	int32_t getHeight() const { return mHeight; }
+	ptrdiff_t getRowBytes() const { return mRowBytes; }
+	uint8_t getPixelInc() const { return mChannelOrder.getPixelInc(); }
+	T * getData() { return mData; }
+	const T * getData() const { return mData; }
+
+  private:
+	T *mData;
+	int32_t mWidth, mHeight;
+	ptrdiff_t mRowBytes;
+	SurfaceChannelOrder mChannelOrder;
+};
+
+} // namespace cinder